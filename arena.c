@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <stdalign.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+struct arena_chunk {
+    struct arena_chunk * next;
+    size_t size;
+    size_t used;
+    alignas(ARENA_ALIGNMENT) char data[];
+};
+
+static struct arena_chunk * arena_new_chunk(struct arena * arena, size_t size) {
+    struct arena_chunk * chunk = malloc(sizeof(struct arena_chunk) + size);
+
+    chunk->size = size;
+    chunk->used = 0;
+
+    ++arena->stats.chunks;
+    arena->stats.reserved += sizeof(struct arena_chunk) + size;
+
+    return chunk;
+}
+
+void arena_init(struct arena * arena, size_t chunk_size) {
+    arena->chunk_size = chunk_size;
+    arena->chunks = NULL;
+
+    arena->stats.chunks = 0;
+    arena->stats.allocations = 0;
+    arena->stats.reserved = 0;
+    arena->stats.used = 0;
+}
+
+void * arena_alloc(struct arena * arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    struct arena_chunk * chunk = arena->chunks;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (size > arena->chunk_size / 4) {
+            // big allocations get a dedicated chunk so the current one keeps its free tail
+            chunk = arena_new_chunk(arena, size);
+
+            if (arena->chunks) {
+                chunk->next = arena->chunks->next;
+                arena->chunks->next = chunk;
+            } else {
+                chunk->next = NULL;
+                arena->chunks = chunk;
+            }
+        } else {
+            chunk = arena_new_chunk(arena, arena->chunk_size);
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+
+    void * result = chunk->data + chunk->used;
+    chunk->used += size;
+
+    ++arena->stats.allocations;
+    arena->stats.used += size;
+
+    return result;
+}
+
+void arena_free(struct arena * arena) {
+    struct arena_chunk * chunk = arena->chunks;
+
+    while (chunk) {
+        struct arena_chunk * next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena_init(arena, arena->chunk_size);
+}
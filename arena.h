@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+#define ARENA_DEFAULT_CHUNK_SIZE (1 << 20)
+
+struct arena_chunk;
+
+struct arena_stats {
+    size_t chunks;
+    size_t allocations;
+    size_t reserved; // bytes requested from malloc
+    size_t used;     // bytes handed out including alignment padding
+};
+
+// chunked bump allocator, memory is only released all at once by arena_free
+struct arena {
+    size_t chunk_size;
+    struct arena_chunk * chunks;
+    struct arena_stats stats;
+};
+
+void arena_init(struct arena * arena, size_t chunk_size);
+void * arena_alloc(struct arena * arena, size_t size);
+void arena_free(struct arena * arena);
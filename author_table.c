@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "author_table.h"
+
+#define AUTHOR_TABLE_CHUNK_SIZE (64 * 1024)
+
+// FNV-1a
+static uint32_t author_table_hash(const char * name, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+void author_table_init(struct author_table * table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->names = NULL;
+    table->lengths = NULL;
+    table->bucket_count = 0;
+    table->buckets = NULL;
+
+    arena_init(&table->arena, AUTHOR_TABLE_CHUNK_SIZE);
+}
+
+// the bucket holding the name or the empty one where it would go
+static uint32_t * author_table_bucket(const struct author_table * table, const char * name, size_t length) {
+    size_t mask = table->bucket_count - 1;
+    size_t index = author_table_hash(name, length) & mask;
+
+    while (table->buckets[index] != AUTHOR_TABLE_NONE) {
+        uint32_t id = table->buckets[index];
+
+        if (table->lengths[id] == length && memcmp(table->names[id], name, length) == 0) {
+            break;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    return &table->buckets[index];
+}
+
+// keeps the load factor under a half
+static void author_table_rehash(struct author_table * table) {
+    free(table->buckets);
+
+    table->bucket_count = table->bucket_count ? table->bucket_count * 2 : 64;
+    table->buckets = calloc(table->bucket_count, sizeof(uint32_t));
+
+    for (uint32_t id = 1; id <= table->count; ++id) {
+        *author_table_bucket(table, table->names[id], table->lengths[id]) = id;
+    }
+}
+
+uint32_t author_table_find(const struct author_table * table, const char * name, size_t length) {
+    if (table->bucket_count == 0) {
+        return AUTHOR_TABLE_NONE;
+    }
+
+    return *author_table_bucket(table, name, length);
+}
+
+uint32_t author_table_intern(struct author_table * table, const char * name, size_t length, bool * added) {
+    uint32_t id = author_table_find(table, name, length);
+
+    *added = id == AUTHOR_TABLE_NONE;
+
+    if (!*added) {
+        return id;
+    }
+
+    if (2 * (table->count + 1) > table->bucket_count) {
+        author_table_rehash(table);
+    }
+
+    // id 0 is never used, so the arrays are indexed by id directly
+    if (table->count + 2 > table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 64;
+        table->names = realloc(table->names, sizeof(const char *) * table->capacity);
+        table->lengths = realloc(table->lengths, sizeof(uint32_t) * table->capacity);
+    }
+
+    char * copy = arena_alloc(&table->arena, length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    id = (uint32_t) ++table->count;
+    table->names[id] = copy;
+    table->lengths[id] = (uint32_t) length;
+
+    *author_table_bucket(table, name, length) = id;
+
+    return id;
+}
+
+void author_table_free(struct author_table * table) {
+    free(table->names);
+    free(table->lengths);
+    free(table->buckets);
+
+    arena_free(&table->arena);
+    author_table_init(table);
+}
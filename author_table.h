@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+#define AUTHOR_TABLE_NONE 0
+
+/*
+ * Interned author names. Every distinct name is stored once in the arena and gets the next id
+ * starting from 1, messages keep only the id. Names never move once interned.
+ */
+struct author_table {
+    size_t count;
+    size_t capacity;
+    const char ** names;  // indexed by id, the names are terminated
+    uint32_t * lengths;
+
+    // open addressing name -> id, AUTHOR_TABLE_NONE marks an empty bucket
+    size_t bucket_count;
+    uint32_t * buckets;
+
+    struct arena arena;
+};
+
+void author_table_init(struct author_table * table);
+// returns the id of the name, added tells whether the name is new
+uint32_t author_table_intern(struct author_table * table, const char * name, size_t length, bool * added);
+// AUTHOR_TABLE_NONE if the name is unknown
+uint32_t author_table_find(const struct author_table * table, const char * name, size_t length);
+void author_table_free(struct author_table * table);
+
+static inline const char * author_table_name(const struct author_table * table, uint32_t id) {
+    return table->names[id];
+}
+
+static inline size_t author_table_length(const struct author_table * table, uint32_t id) {
+    return table->lengths[id];
+}
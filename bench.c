@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+#include "protocol.h"
+#include "journal.h"
+#include "message_store.h"
+#include "author_table.h"
+#include "registry.h"
+
+#define FANOUT_MESSAGES 1000
+#define FANOUT_TEXT_LENGTH 256
+#define SENDS_MESSAGES 100000
+#define SENDS_FIELDS 6
+#define REGISTRY_BROADCASTERS 4
+#define REGISTRY_CHURNERS 2
+#define REGISTRY_ITEMS 64
+#define REGISTRY_ALIVE 0x53323635u
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * Compares fan-out of one message to every client queue:
+ * copy - the frame is encoded into its own buffer for every recipient,
+ * shared - the frame is encoded once and recipients get a reference to it.
+ * Queues are drained without sockets so only the fan-out itself is measured.
+ */
+static void bench_fanout(size_t clients) {
+    struct output_queue * queues = malloc(sizeof(struct output_queue) * clients);
+    char text[FANOUT_TEXT_LENGTH];
+
+    memset(text, 'x', sizeof(text));
+
+    for (size_t i = 0; i < clients; ++i) {
+        output_queue_init(&queues[i]);
+    }
+
+    for (int shared = 0; shared <= 1; ++shared) {
+        double elapsed = 0;
+
+        for (long long id = 1; id <= FANOUT_MESSAGES; ++id) {
+            size_t frame_length = protocol_message_length(id, 0, 1, sizeof(text));
+            double start = now();
+
+            if (shared) {
+                struct frame * frame = frame_new(frame_length);
+                protocol_encode_message(frame->data, id, 0, 1, text, sizeof(text));
+
+                for (size_t i = 0; i < clients; ++i) {
+                    output_queue_push(&queues[i], frame_ref(frame));
+                }
+
+                frame_unref(frame);
+            } else {
+                for (size_t i = 0; i < clients; ++i) {
+                    struct frame * frame = frame_new(frame_length);
+                    protocol_encode_message(frame->data, id, 0, 1, text, sizeof(text));
+
+                    output_queue_push(&queues[i], frame);
+                }
+            }
+
+            elapsed += now() - start;
+
+            // keeps the memory bounded, not measured
+            if (id % 100 == 0) {
+                for (size_t i = 0; i < clients; ++i) {
+                    output_queue_clear(&queues[i]);
+                }
+            }
+        }
+
+        printf("fanout clients=%zu mode=%s messages=%d total=%.3fms per_message=%.1fus per_recipient=%.1fns\n",
+               clients, shared ? "shared" : "copy", FANOUT_MESSAGES, elapsed * 1e3,
+               elapsed / FANOUT_MESSAGES * 1e6, elapsed / FANOUT_MESSAGES / (double) clients * 1e9);
+    }
+
+    for (size_t i = 0; i < clients; ++i) {
+        output_queue_free(&queues[i]);
+    }
+
+    free(queues);
+}
+
+static void * sends_drain(void * param) {
+    int socket = *(int *) param;
+    char buffer[64 * 1024];
+
+    while (read(socket, buffer, sizeof(buffer)) > 0);
+
+    return NULL;
+}
+
+// one send of the whole buffer, returns the number of calls it took
+static size_t sends_write(int socket, const char * data, size_t length) {
+    size_t calls = 0;
+
+    while (length > 0) {
+        ssize_t ret = send(socket, data, length, MSG_NOSIGNAL);
+        ++calls;
+
+        if (ret <= 0) {
+            break;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return calls;
+}
+
+/*
+ * Counts the send calls that deliver the same history to one client over a socket pair:
+ * fields - every message is written field by field as the protocol was written before the frames,
+ * frame - one send per encoded frame as the broadcast does,
+ * queued - the frames are gathered from an output queue into sendmsg calls as the replay does.
+ */
+static void bench_sends(void) {
+    const char * text = "a typical chat message of moderate length";
+    size_t text_length = strlen(text);
+    size_t calls[3] = {0, 0, 0};
+    const char * names[] = {"fields", "frame", "queued"};
+
+    for (int mode = 0; mode < 3; ++mode) {
+        int sockets[2];
+        pthread_t drainer;
+
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+        pthread_create(&drainer, NULL, sends_drain, &sockets[1]);
+
+        struct output_queue queue;
+        output_queue_init(&queue);
+
+        double start = now();
+
+        for (long long id = 1; id <= SENDS_MESSAGES; ++id) {
+            long long reply_id = id % 3 == 0 ? id / 2 : 0;
+            struct frame * frame = frame_new(protocol_message_length(id, reply_id, 1, text_length));
+
+            protocol_encode_message(frame->data, id, reply_id, 1, text, text_length);
+
+            if (mode == 0) {
+                // the pieces are about as many as the fields were, the bytes on the wire stay the same
+                size_t piece = (frame->length + SENDS_FIELDS - 1) / SENDS_FIELDS;
+
+                for (size_t offset = 0; offset < frame->length; offset += piece) {
+                    calls[mode] += sends_write(sockets[0], frame->data + offset,
+                                               frame->length - offset < piece ? frame->length - offset : piece);
+                }
+
+                frame_unref(frame);
+            } else if (mode == 1) {
+                calls[mode] += sends_write(sockets[0], frame->data, frame->length);
+                frame_unref(frame);
+            } else {
+                output_queue_push(&queue, frame);
+            }
+        }
+
+        while (queue.count > 0) {
+            struct iovec iov[OUTPUT_QUEUE_IOVECS];
+            struct msghdr message = {
+                .msg_iov = iov,
+                .msg_iovlen = output_queue_gather(&queue, iov, OUTPUT_QUEUE_IOVECS),
+            };
+
+            ssize_t ret = sendmsg(sockets[0], &message, MSG_NOSIGNAL);
+            ++calls[mode];
+
+            if (ret <= 0) {
+                break;
+            }
+
+            output_queue_consume(&queue, ret);
+        }
+
+        double elapsed = now() - start;
+
+        output_queue_free(&queue);
+        close(sockets[0]);
+        pthread_join(drainer, NULL);
+        close(sockets[1]);
+
+        printf("sends mode=%s messages=%d calls=%zu per_message=%.3f time=%.1fms\n",
+               names[mode], SENDS_MESSAGES, calls[mode], (double) calls[mode] / SENDS_MESSAGES, elapsed * 1e3);
+    }
+
+    printf("sends fields/frame=%.1fx fields/queued=%.1fx\n",
+           (double) calls[0] / (double) calls[1], (double) calls[0] / (double) calls[2]);
+}
+
+struct recovery_state {
+    struct message_store store;
+    struct author_table authors;
+};
+
+// recovery cost includes building the same store and author table the server uses
+static void recovery_store_add(void * param, long long id, long long reply_id,
+                               const char * author, size_t author_length,
+                               const char * text, size_t text_length) {
+    struct recovery_state * state = param;
+    char * copy = message_store_alloc_text(&state->store, text_length);
+    bool added;
+    uint32_t author_id = author_table_intern(&state->authors, author, author_length, &added);
+
+    memcpy(copy, text, text_length);
+    message_store_add(&state->store, id, reply_id, author_id, copy, text_length);
+}
+
+static double bench_recover(const char * path, struct journal_stats * stats) {
+    struct recovery_state state;
+    struct journal journal;
+
+    message_store_init(&state.store);
+    author_table_init(&state.authors);
+
+    double start = now();
+
+    if (!journal_open(&journal, path, 0, recovery_store_add, &state)) {
+        printf("Cannot open %s\n", path);
+        exit(1);
+    }
+
+    double elapsed = now() - start;
+
+    *stats = journal.stats;
+    journal_close(&journal);
+
+    message_store_free(&state.store);
+    author_table_free(&state.authors);
+
+    return elapsed;
+}
+
+/*
+ * Writes a log of the given size with every third message being a reply,
+ * then measures recovery into an in-memory store and repair of a torn tail.
+ */
+static void bench_recovery(const char * path, long long count) {
+    struct journal journal;
+    struct journal_stats stats;
+    const char * authors[] = {"alice", "bob", "carol", "dave"};
+    const char * text = "a typical chat message of moderate length";
+
+    unlink(path);
+
+    double start = now();
+
+    if (!journal_open(&journal, path, 1000, NULL, NULL)) {
+        printf("Cannot open %s\n", path);
+        exit(1);
+    }
+
+    for (long long id = 1; id <= count; ++id) {
+        const char * author = authors[id % 4];
+        long long reply_id = id % 3 == 0 ? id / 2 : 0;
+
+        journal_append(&journal, id, reply_id, author, strlen(author), text, strlen(text));
+    }
+
+    journal_close(&journal);
+
+    printf("recovery write messages=%lld bytes=%zu time=%.1fms\n", count, journal.stats.bytes, (now() - start) * 1e3);
+
+    double elapsed = bench_recover(path, &stats);
+    printf("recovery replay messages=%zu time=%.1fms per_message=%.1fns\n",
+           stats.records, elapsed * 1e3, elapsed / (double) stats.records * 1e9);
+
+    // cuts the last record in half as a crash in the middle of a write would
+    truncate(path, (off_t) stats.bytes - 20);
+
+    elapsed = bench_recover(path, &stats);
+    printf("recovery torn_tail messages=%zu truncated=%zu time=%.1fms\n", stats.records, stats.truncated_bytes, elapsed * 1e3);
+
+    unlink(path);
+}
+
+struct registry_item {
+    unsigned alive;
+    atomic_size_t deliveries;
+};
+
+struct registry_stress {
+    struct registry registry;
+    atomic_bool stopping;
+    atomic_size_t broadcasts;
+    atomic_size_t changes;
+    atomic_size_t dead_seen;
+};
+
+// poisoned before it is freed, a broadcast that still reaches it is a reclamation bug
+static void registry_item_free(void * param) {
+    struct registry_item * item = param;
+
+    item->alive = 0;
+    free(item);
+}
+
+static void * registry_broadcaster(void * param) {
+    struct registry_stress * stress = param;
+    size_t broadcasts = 0;
+
+    while (!atomic_load(&stress->stopping)) {
+        const struct registry_snapshot * snapshot = registry_read_begin(&stress->registry);
+
+        for (size_t i = 0; i < snapshot->count; ++i) {
+            struct registry_item * item = snapshot->items[i];
+
+            if (item->alive != REGISTRY_ALIVE) {
+                atomic_fetch_add(&stress->dead_seen, 1);
+            }
+
+            atomic_fetch_add_explicit(&item->deliveries, 1, memory_order_relaxed);
+        }
+
+        registry_read_end(&stress->registry);
+        ++broadcasts;
+    }
+
+    atomic_fetch_add(&stress->broadcasts, broadcasts);
+    return NULL;
+}
+
+// joins and leaves in a random order, every churner owns its items
+static void * registry_churner(void * param) {
+    struct registry_stress * stress = param;
+    struct registry_item * items[REGISTRY_ITEMS] = {NULL};
+    unsigned seed = (unsigned) (size_t) &items;
+    size_t changes = 0;
+
+    while (!atomic_load(&stress->stopping)) {
+        size_t index = (size_t) rand_r(&seed) % REGISTRY_ITEMS;
+
+        if (items[index]) {
+            registry_remove(&stress->registry, items[index]);
+            items[index] = NULL;
+        } else {
+            items[index] = malloc(sizeof(struct registry_item));
+            items[index]->alive = REGISTRY_ALIVE;
+            atomic_init(&items[index]->deliveries, 0);
+
+            registry_add(&stress->registry, items[index]);
+        }
+
+        ++changes;
+    }
+
+    for (size_t i = 0; i < REGISTRY_ITEMS; ++i) {
+        if (items[i]) {
+            registry_remove(&stress->registry, items[i]);
+        }
+    }
+
+    atomic_fetch_add(&stress->changes, changes);
+    return NULL;
+}
+
+/*
+ * Broadcasters iterate the registry while churners keep adding and removing items.
+ * Meant to be run from a build with -DSANITIZE=thread as well, which reports any access
+ * to an item or a snapshot that races with its reclamation.
+ */
+static int bench_registry(double seconds) {
+    struct registry_stress stress;
+    pthread_t broadcasters[REGISTRY_BROADCASTERS], churners[REGISTRY_CHURNERS];
+
+    registry_init(&stress.registry, registry_item_free);
+    atomic_init(&stress.stopping, false);
+    atomic_init(&stress.broadcasts, 0);
+    atomic_init(&stress.changes, 0);
+    atomic_init(&stress.dead_seen, 0);
+
+    for (int i = 0; i < REGISTRY_BROADCASTERS; ++i) {
+        pthread_create(&broadcasters[i], NULL, registry_broadcaster, &stress);
+    }
+
+    for (int i = 0; i < REGISTRY_CHURNERS; ++i) {
+        pthread_create(&churners[i], NULL, registry_churner, &stress);
+    }
+
+    usleep((useconds_t) (seconds * 1e6));
+    atomic_store(&stress.stopping, true);
+
+    for (int i = 0; i < REGISTRY_BROADCASTERS; ++i) {
+        pthread_join(broadcasters[i], NULL);
+    }
+
+    for (int i = 0; i < REGISTRY_CHURNERS; ++i) {
+        pthread_join(churners[i], NULL);
+    }
+
+    size_t dead_seen = atomic_load(&stress.dead_seen);
+
+    printf("registry broadcasters=%d churners=%d broadcasts=%zu changes=%zu dead_seen=%zu\n",
+           REGISTRY_BROADCASTERS, REGISTRY_CHURNERS, atomic_load(&stress.broadcasts), atomic_load(&stress.changes), dead_seen);
+
+    registry_free(&stress.registry);
+
+    return dead_seen == 0 ? 0 : 1;
+}
+
+int main(int argc, char * argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s fanout | sends | recovery <log file> [messages] | registry [seconds]\n", argv[0]);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "fanout") == 0) {
+        bench_fanout(1000);
+        bench_fanout(10000);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "sends") == 0) {
+        bench_sends();
+        return 0;
+    }
+
+    if (strcmp(argv[1], "recovery") == 0 && argc >= 3) {
+        bench_recovery(argv[2], argc >= 4 ? atoll(argv[3]) : 10000000);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "registry") == 0) {
+        return bench_registry(argc >= 3 ? atof(argv[2]) : 5);
+    }
+
+    printf("Unknown benchmark: %s\n", argv[1]);
+    return 1;
+}
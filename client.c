@@ -4,26 +4,35 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include <sys/ioctl.h>
-#include <pthread.h>
+#include <poll.h>
+#include <getopt.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include "terminal.h"
+#include "message_store.h"
+#include "protocol.h"
+#include "author_table.h"
+#include "history_cache.h"
 
 #define CSI "\x1B["
 
-struct message {
-    struct message * next;
-
-    long long id;
-    char * author;
-    char * text;
-    bool read;
-    bool collapsed;
-
-    struct message * children;
+#define RECONNECT_ATTEMPTS 10
+#define RECONNECT_MAX_DELAY 5000
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define DEFAULT_FRAME_INTERVAL 16
+
+// what the client knows about a thread beyond its messages
+struct thread_state {
+    // replies of the folded thread the client has not got, from summaries and activity frames
+    uint32_t activity;
+    // the next page of the thread starts after this id, 0 if there is nothing left to fetch
+    long long next_page;
 };
 
 struct context {
@@ -32,10 +41,10 @@ struct context {
     int socket;
 
     struct {
-        int top;
+        long long top_id;
         int left;
-        int width;
-        int height;
+        size_t width;
+        size_t height;
         long long reply_id;
         long long selected_id;
         bool writing;
@@ -46,131 +55,221 @@ struct context {
             size_t length;
             char * buffer;
         } input;
+        size_t input_column;
+
+        struct screen screen;
+        int32_t * rows; // slots of the messages on the screen
+
+        // redraws are deferred until the next frame
+        unsigned frame_interval;
+        long long last_frame;
+        bool dirty;
+        bool input_dirty;
     } ui;
 
-    struct message * messages;
+    struct protocol_reader received;
+    // the server has answered the hello of the current connection
+    bool welcomed;
+
+    // the socket is -1 while the client waits for the next connection attempt
+    struct {
+        int attempts;
+        unsigned delay;
+        long long at;
+    } reconnect;
+
+    struct message_store store;
+    // names of the messages in the store, ids are local to the client
+    struct author_table authors;
+    // author ids of the current connection -> local ids, AUTHOR_TABLE_NONE for the ones not announced yet
+    struct {
+        size_t capacity;
+        uint32_t * ids;
+    } remote_authors;
+    // the local id of the own username, threads started by the user are followed from the start
+    uint32_t own_author;
+    // the history starts as roots with thread summaries, replies are fetched when a thread is unfolded
+    bool lazy;
+    // per slot, only roots use it
+    struct {
+        size_t capacity;
+        struct thread_state * items;
+    } threads;
+    // the highest id received, the server only sends newer messages after a reconnect
+    long long last_id;
+    // the history the messages belong to, 0 before the first welcome
+    uint64_t history_id;
+    // the history of earlier runs with this server, slots of the store are its records
+    struct history_cache cache;
+    bool cached;
     bool stopping;
 };
 
+static long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 static int do_connect(struct context * context) {
     context->socket = socket(AF_INET, SOCK_STREAM, 0);
-    return connect(context->socket, (struct sockaddr *) &context->server_address, sizeof(context->server_address));
-}
 
-static void reconnect(struct context * context) {
-    for (int i = 0; i < 10; ++i) {
-        close(context->socket);
+    // subscriptions and posts are small frames, Nagle would hold them back
+    int nodelay = 1;
+    setsockopt(context->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-        if (do_connect(context) == 0) {
-            return;
-        }
+    char hello[PROTOCOL_HELLO_LENGTH];
+    size_t hello_length = protocol_encode_hello(hello, context->last_id, context->username, strlen(context->username),
+                                                context->lazy ? PROTOCOL_HELLO_LAZY : 0, context->history_id);
+
+    if (connect(context->socket, (struct sockaddr *) &context->server_address, sizeof(context->server_address)) ||
+        write(context->socket, hello, hello_length) != (ssize_t) hello_length) {
+        close(context->socket);
+        context->socket = -1;
+        return -1;
     }
 
-    printf("Cannot connect to remote host.\n");
-    context->stopping = true;
+    protocol_reader_reset(&context->received);
+    context->welcomed = false;
+    return 0;
 }
 
-static struct message * message_find_by_id(struct message * message, long long id) {
-    for (struct message * msg = message; msg; msg = msg->next) {
-        if (msg->id == id) {
-            return msg;
-        }
+// randomized backoff spreads the reconnects of many clients after a server restart
+static void context_schedule_reconnect(struct context * context) {
+    // the reason is printed once the screen is reset
+    if (context->reconnect.attempts++ == RECONNECT_ATTEMPTS) {
+        context->stopping = true;
+        return;
+    }
 
-        struct message * child = message_find_by_id(msg->children, id);
-        if (child) {
-            return child;
-        }
+    unsigned delay = context->reconnect.delay;
+    context->reconnect.at = now_ms() + delay / 2 + (unsigned) rand() % (delay / 2 + 1);
+
+    if (context->reconnect.delay < RECONNECT_MAX_DELAY) {
+        context->reconnect.delay *= 2;
     }
+}
 
-    return NULL;
+static void context_reconnect(struct context * context) {
+    if (do_connect(context) == 0) {
+        context->reconnect.attempts = 0;
+        context->reconnect.delay = 100;
+    } else {
+        context_schedule_reconnect(context);
+    }
 }
 
-static void context_draw_buffer_bounds(struct message * messages, size_t * width, size_t * height) {
-    for (struct message * msg = messages; msg; msg = msg->next) {
-        ++(*height);
+static void context_connection_lost(struct context * context) {
+    close(context->socket);
+    context->socket = -1;
+    context_reconnect(context);
+}
 
-        size_t message_width = 2 + strlen(msg->author) + 2 + strlen(msg->text);
+static struct thread_state * context_thread(struct context * context, int32_t root) {
+    if ((size_t) root >= context->threads.capacity) {
+        size_t capacity = context->threads.capacity ? context->threads.capacity : 1024;
 
-        if (!msg->collapsed) {
-            size_t children_width = 0, children_height = 0;
-            context_draw_buffer_bounds(msg->children, &children_width, &children_height);
+        while (capacity <= (size_t) root) {
+            capacity *= 2;
+        }
 
-            children_width += 1;
-            if (children_width > message_width) {
-                message_width = children_width;
-            }
+        context->threads.items = realloc(context->threads.items, sizeof(struct thread_state) * capacity);
+        memset(context->threads.items + context->threads.capacity, 0,
+               sizeof(struct thread_state) * (capacity - context->threads.capacity));
+        context->threads.capacity = capacity;
+    }
 
-            *height += children_height;
-        }
+    return &context->threads.items[root];
+}
 
-        if (message_width > *width) {
-            *width = message_width;
-        }
+// the record of a message in the cache follows its flags, the next flush writes them
+static void context_flags_changed(struct context * context, int32_t slot) {
+    if (context->cached) {
+        history_cache_set_flags(&context->cache, (size_t) slot, context->store.flags[slot]);
     }
 }
 
-static size_t context_draw_buffer_line(char * buffer, const char * line, size_t top, size_t left, size_t width) {
-    size_t length = strlen(line);
+// asks the server for the replies of a thread or stops them, replies of the others are only counted;
+// a lazy client fetches what it misses of the thread page by page instead, the last page subscribes it
+static void context_subscribe(struct context * context, int32_t root, bool subscribed) {
+    struct message_store * store = &context->store;
+    char frame[PROTOCOL_SUBSCRIBE_LENGTH];
+    size_t length = subscribed && context->lazy ?
+                    protocol_encode_fetch(frame, store->ids[root], store->latest_ids[root]) :
+                    protocol_encode_subscribe(frame, store->ids[root], subscribed);
 
-    memcpy(buffer + top * width + left, line, length);
+    context_thread(context, root)->next_page = 0;
 
-    return left + length;
+    if (context->socket >= 0) {
+        write(context->socket, frame, length);
+    }
 }
 
-static bool message_is_branch_read(struct message * message) {
-    for (struct message * msg = message; msg; msg = msg->next) {
-        if (!msg->read) {
-            return false;
-        }
+// a folded thread is not followed, unfolding it fetches the replies it missed
+static void context_toggle_thread(struct context * context, int32_t root) {
+    struct message_store * store = &context->store;
 
-        if (!message_is_branch_read(message->children)) {
-            return false;
-        }
+    store->flags[root] ^= MESSAGE_COLLAPSED;
+    context_flags_changed(context, root);
+
+    bool subscribed = !(store->flags[root] & MESSAGE_COLLAPSED);
+
+    if (subscribed) {
+        context_thread(context, root)->activity = 0;
     }
 
-    return true;
+    context_subscribe(context, root, subscribed);
 }
 
-static int context_draw_buffer_messages(char * buffer, struct context * context, struct message * messages, int top, int left, size_t width, int * selected_top, struct message ** buffer_messages) {
-    for (struct message * msg = messages; msg; msg = msg->next) {
-        for (int i = 0; i < left; ++i) {
-            buffer[top * width + i] = ' ';
+// the server forgets subscriptions with the connection
+static void context_resubscribe(struct context * context) {
+    struct message_store * store = &context->store;
+
+    for (int32_t root = store->first_root; root != MESSAGE_STORE_NONE; root = store->next_siblings[root]) {
+        if (!(store->flags[root] & MESSAGE_COLLAPSED)) {
+            context_subscribe(context, root, true);
         }
+    }
+}
 
-        size_t local_left = left;
+// a page of an unfolded thread has come and the last message of the thread is on the screen, so the next one is needed
+static void context_fetch_next_page(struct context * context, int32_t slot) {
+    struct message_store * store = &context->store;
+    int32_t root = store->roots[slot];
 
-        if (context->ui.selected_id == msg->id) {
-            *selected_top = top;
-        }
+    if ((size_t) root >= context->threads.capacity || context->threads.items[root].next_page == 0) {
+        return;
+    }
 
-        if (context->ui.reply_id == msg->id) {
-            buffer[top * width + local_left] = '>';
-        } else if (!msg->read || !message_is_branch_read(msg->children)) {
-            buffer[top * width + local_left] = '!';
-        } else {
-            buffer[top * width + local_left] = ' ';
-        }
+    // pages land in the middle of the pre-order, so it is brought up to date first
+    message_store_order(store);
 
-        if (msg->collapsed) {
-            buffer[top * width + local_left + 1] = '+';
-        } else {
-            buffer[top * width + local_left + 1] = ' ';
-        }
+    if (store->positions[slot] + 1 != store->positions[root] + store->subtree_sizes[root]) {
+        return;
+    }
 
-        local_left = context_draw_buffer_line(buffer, msg->author, top, local_left + 2, width);
-        local_left = context_draw_buffer_line(buffer, ": ", top, local_left, width);
-        local_left = context_draw_buffer_line(buffer, msg->text, top, local_left, width);
-        memset(buffer + top * width + local_left, ' ', width - local_left);
+    char frame[PROTOCOL_SUBSCRIBE_LENGTH];
+    size_t length = protocol_encode_fetch(frame, store->ids[root], context->threads.items[root].next_page);
 
-        buffer_messages[top] = msg;
-        ++top;
+    context->threads.items[root].next_page = 0;
 
-        if (!msg->collapsed) {
-            top = context_draw_buffer_messages(buffer, context, msg->children, top, left + 1, width, selected_top, buffer_messages);
-        }
+    if (context->socket >= 0) {
+        write(context->socket, frame, length);
     }
+}
+
+// copies the part of a piece placed at the given column of a message line that is inside the screen
+static size_t context_draw_span(struct context * context, char * line, const char * data, size_t length, size_t column) {
+    size_t left = (size_t) context->ui.left, right = left + context->ui.width;
+    size_t begin = column > left ? column : left;
+    size_t end = column + length < right ? column + length : right;
 
-    return top;
+    if (begin < end) {
+        memcpy(line + begin - left, data + begin - column, end - begin);
+    }
+
+    return column + length;
 }
 
 /*
@@ -178,302 +277,716 @@ static int context_draw_buffer_messages(char * buffer, struct context * context,
  *  > b: hello
  *    d: mmm
  * !+c: oaoaoa
+ *  +(3) e: replies of a folded thread are only counted
  */
-static char * context_draw_buffer(struct context * context, size_t * width, size_t * height, int * selected_top, struct message *** buffer_messages) {
-    char * buffer;
+static void context_draw_message(struct context * context, char * line, int32_t slot) {
+    struct message_store * store = &context->store;
+    size_t column = store->depths[slot];
+    char marks[2];
+
+    if (context->ui.reply_id == store->ids[slot]) {
+        marks[0] = '>';
+    } else if (store->unread[slot] > 0) {
+        marks[0] = '!';
+    } else {
+        marks[0] = ' ';
+    }
+
+    marks[1] = store->flags[slot] & MESSAGE_COLLAPSED ? '+' : ' ';
+
+    uint32_t author = store->authors[slot];
+    const char * name = author == AUTHOR_TABLE_NONE ? "?" : author_table_name(&context->authors, author);
+    size_t name_length = author == AUTHOR_TABLE_NONE ? 1 : author_table_length(&context->authors, author);
+
+    column = context_draw_span(context, line, marks, 2, column);
+
+    if ((store->flags[slot] & MESSAGE_COLLAPSED) && (size_t) slot < context->threads.capacity &&
+        context->threads.items[slot].activity > 0) {
+        char activity[16];
+        int activity_length = snprintf(activity, sizeof(activity), "(%u) ", context->threads.items[slot].activity);
 
-    context_draw_buffer_bounds(context->messages, width, height);
+        column = context_draw_span(context, line, activity, (size_t) activity_length, column);
+    }
+
+    column = context_draw_span(context, line, name, name_length, column);
+    column = context_draw_span(context, line, ": ", 2, column);
+    context_draw_span(context, line, message_store_text(store, slot), store->text_lengths[slot], column);
+}
+
+// the messages shown from the given top one down to the bottom of the view
+static size_t context_fill_rows(struct context * context, int32_t top) {
+    size_t count = 0;
+
+    for (int32_t slot = top; slot != MESSAGE_STORE_NONE && count < context->ui.height - 2;
+         slot = message_store_next_visible(&context->store, slot)) {
+        context->ui.rows[count++] = slot;
+    }
+
+    return count;
+}
+
+static size_t context_find_row(struct context * context, size_t count, int32_t slot) {
+    size_t row = 0;
+
+    while (row < count && context->ui.rows[row] != slot) {
+        ++row;
+    }
+
+    return row;
+}
+
+static void context_draw_input(struct context * context) {
+    struct screen * screen = &context->ui.screen;
+    char * line = screen_row(screen, screen->height - 1);
+    const char * prompt = "Your message: ";
+    size_t prompt_length = strlen(prompt) < screen->width ? strlen(prompt) : screen->width;
+
+    memcpy(line, prompt, prompt_length);
 
-    buffer = malloc(*width * *height);
-    *buffer_messages = malloc(sizeof(struct message *) * *height);
-    context_draw_buffer_messages(buffer, context, context->messages, 0, 0, *width, selected_top, *buffer_messages);
+    char * input_start = context->ui.input.buffer;
+    size_t input_length = context->ui.input.length;
+    size_t room = screen->width - prompt_length;
 
-    return buffer;
+    if (input_length > room) {
+        input_start += input_length - room;
+        input_length = room;
+    }
+
+    memcpy(line + prompt_length, input_start, input_length);
+    context->ui.input_column = prompt_length + input_length;
 }
 
+// a keystroke in the input line leaves the rest of the frame as it is
+static void context_redraw_input(struct context * context) {
+    context_draw_input(context);
+    screen_flush(&context->ui.screen, context->ui.screen.height - 1, context->ui.input_column);
+}
+
+// only the rows on the screen are visited, the view is anchored at its top message
 static void context_redraw_screen(struct context * context) {
-    size_t width = 0, height = 0;
-    int selected_top = 0;
+    struct screen * screen = &context->ui.screen;
+    struct message_store * store = &context->store;
+    int32_t selected = message_store_find(store, context->ui.selected_id);
+    int32_t top = message_store_find(store, context->ui.top_id);
 
-    if (context->ui.selected_id == 0 && context->messages) {
-        context->ui.selected_id = context->messages->id;
+    if (selected == MESSAGE_STORE_NONE) {
+        selected = store->first_root;
     }
 
-    struct message ** buffer_messages;
-    char * buffer = context_draw_buffer(context, &width, &height, &selected_top, &buffer_messages);
+    if (top == MESSAGE_STORE_NONE) {
+        top = store->first_root;
+    }
 
-    if (context->ui.move != 0) {
-        selected_top += context->ui.move;
+    for (; context->ui.move < 0 && selected != MESSAGE_STORE_NONE; ++context->ui.move) {
+        int32_t previous = message_store_previous_visible(store, selected);
 
-        if (selected_top < 0) {
-            selected_top = 0;
-        } else if (selected_top >= height) {
-            if (height == 0) {
-                selected_top = 0;
-            } else {
-                selected_top = (int) height - 1;
-            }
+        if (previous == MESSAGE_STORE_NONE) {
+            break;
         }
 
-        if (selected_top > 0 && selected_top < height) {
-            context->ui.selected_id = buffer_messages[selected_top]->id;
+        if (selected == top) {
+            top = previous;
         }
 
-        context->ui.move = 0;
+        selected = previous;
     }
 
-    if (selected_top < context->ui.top) {
-        context->ui.top = selected_top;
-    } else if (selected_top >= context->ui.top + context->ui.height - 2) {
-        context->ui.top = selected_top - (context->ui.height - 2) + 1;
+    for (; context->ui.move > 0 && selected != MESSAGE_STORE_NONE; --context->ui.move) {
+        int32_t next = message_store_next_visible(store, selected);
+
+        if (next == MESSAGE_STORE_NONE) {
+            break;
+        }
+
+        selected = next;
     }
 
-    printf(CSI"2J");
+    context->ui.move = 0;
+
+    size_t count = context_fill_rows(context, top);
+    size_t selected_row = context_find_row(context, count, selected);
+
+    if (selected != MESSAGE_STORE_NONE && selected_row == count) {
+        // the selection is below the view, scroll so that it becomes the last row
+        top = selected;
 
-    size_t top;
-    for (top = context->ui.top; top < height && top - context->ui.top < context->ui.height - 2; ++top) {
-        printf(CSI"%zu;1H", top - context->ui.top + 1);
-        fflush(stdout);
+        for (size_t row = 1; row < context->ui.height - 2; ++row) {
+            int32_t previous = message_store_previous_visible(store, top);
 
-        size_t buffer_line = width - context->ui.left;
+            if (previous == MESSAGE_STORE_NONE) {
+                break;
+            }
 
-        write(STDOUT_FILENO, buffer + top * width + context->ui.left,
-              buffer_line < context->ui.width ? buffer_line : context->ui.width);
+            top = previous;
+        }
 
-        buffer_messages[top]->read = true;
+        count = context_fill_rows(context, top);
+        selected_row = context_find_row(context, count, selected);
     }
 
-    top = context->ui.height - 1;
+    context->ui.selected_id = selected == MESSAGE_STORE_NONE ? 0 : store->ids[selected];
+    context->ui.top_id = top == MESSAGE_STORE_NONE ? 0 : store->ids[top];
+
+    for (size_t row = 0; row < context->ui.height - 2; ++row) {
+        char * line = screen_row(screen, row);
+
+        if (row < count) {
+            context_draw_message(context, line, context->ui.rows[row]);
+            message_store_mark_read(store, context->ui.rows[row]);
+            context_flags_changed(context, context->ui.rows[row]);
+            context_fetch_next_page(context, context->ui.rows[row]);
+        }
+    }
 
-    const char * help = " q - quit, r - reply, n - new, c - collapse (fold), wasd - moving";
+    const char * help = " q - quit, r - reply, n - new, c - collapse (fold, follows threads), wasd - moving";
     size_t help_length = strlen(help);
     size_t help_left = context->ui.left % help_length;
     help_length -= help_left;
 
-    printf(CSI"%zu;1H", top);
-    fflush(stdout);
-
-    write(STDOUT_FILENO, help + help_left, help_length < context->ui.width ? help_length : context->ui.width);
-    ++top;
+    char * status = screen_row(screen, context->ui.height - 2);
+    memcpy(status, help + help_left, help_length < context->ui.width ? help_length : context->ui.width);
 
-    printf(CSI"%zu;1HYour message: ", top);
-    fflush(stdout);
-
-    char * input_start = context->ui.input.buffer;
-    size_t input_length = context->ui.input.length;
+    if (store->unread_total > 0) {
+        char unread[32];
+        int unread_length = snprintf(unread, sizeof(unread), " %zu unread ", store->unread_total);
 
-    if (context->ui.input.length > context->ui.width - 15) {
-        input_start += input_length - (context->ui.width - 15);
-        input_length = context->ui.width - 15;
+        if ((size_t) unread_length < context->ui.width) {
+            memcpy(status + context->ui.width - unread_length, unread, (size_t) unread_length);
+        }
     }
 
-    write(STDOUT_FILENO, input_start, input_length);
+    context_draw_input(context);
 
     if (context->ui.writing) {
-        printf(CSI"%zu;%zuH", top, input_length + 15);
+        screen_flush(screen, context->ui.height - 1, context->ui.input_column);
     } else {
-        printf(CSI"%d;1H", selected_top - context->ui.top + 1);
+        screen_flush(screen, selected_row < count ? selected_row : 0, 0);
     }
+}
 
-    fflush(stdout);
-    free(buffer_messages);
-    free(buffer);
+// ids index a dense table, so one out of range is never taken from the server or the cache
+static bool context_valid_id(long long id, long long reply_id) {
+    return id > 0 && id <= MESSAGE_STORE_MAX_ID && reply_id >= 0 && reply_id < id;
 }
 
-static void context_add_message(struct context * context, long long id, long long reply_id, const char * username, const char * message) {
-    struct message * parent = NULL;
+static void context_add_message(struct context * context, long long id, long long reply_id,
+                                uint32_t author, char * text, size_t message_length) {
+    // the server may resend what was queued for the previous connection
+    if (!context_valid_id(id, reply_id) || message_store_find(&context->store, id) != MESSAGE_STORE_NONE) {
+        return;
+    }
 
-    if (reply_id) {
-        parent = message_find_by_id(context->messages, reply_id);
+    if (id > context->last_id) {
+        context->last_id = id;
     }
 
-    struct message ** list = parent ? &parent->children : &context->messages;
-    for (struct message * msg = *list; msg; msg = msg->next) {
-        if (msg->id > id) {
-            break;
-        }
+    int32_t slot = message_store_add(&context->store, id, reply_id, author, text, message_length);
+
+    // threads of others start folded, the own ones are followed at once
+    if (context->store.parents[slot] == MESSAGE_STORE_NONE) {
+        context->store.flags[slot] |= MESSAGE_COLLAPSED;
 
-        list = &msg->next;
+        if (author == context->own_author) {
+            context_toggle_thread(context, slot);
+        }
     }
 
-    struct message * new_message = malloc(sizeof(struct message));
+    if (context->cached) {
+        bool known = author != AUTHOR_TABLE_NONE;
 
-    new_message->next = *list;
-    new_message->id = id;
-    new_message->author = strdup(username);
-    new_message->text = strdup(message);
-    new_message->read = false;
-    new_message->collapsed = false;
-    new_message->children = NULL;
-    *list = new_message;
+        history_cache_append(&context->cache, id, reply_id,
+                             known ? author_table_name(&context->authors, author) : "",
+                             known ? author_table_length(&context->authors, author) : 0,
+                             text, message_length, context->store.flags[slot]);
+    }
 
-    context_redraw_screen(context);
+    context->ui.dirty = true;
 }
 
-// packet: <id><reply_id or 0><strlen(username)><username><strlen(message)><message>
-static void * listen_to_server(void * param) {
+// a message of the cache comes back with the flags it had, the server is asked only for newer ones
+static bool context_restore_message(void * param, long long id, long long reply_id,
+                                    const char * author, size_t author_length,
+                                    char * text, size_t text_length, uint8_t flags) {
     struct context * context = param;
+    struct message_store * store = &context->store;
+    bool added;
 
-    while (!context->stopping) {
-        long long id, reply_id;
+    if (!context_valid_id(id, reply_id) || message_store_find(store, id) != MESSAGE_STORE_NONE) {
+        return false;
+    }
 
-        if (read(context->socket, &id, sizeof(id)) < 0) {
-            if (!context->stopping) {
-                reconnect(context);
-            }
+    uint32_t local = author_length ? author_table_intern(&context->authors, author, author_length, &added) : AUTHOR_TABLE_NONE;
+    int32_t slot = message_store_add(store, id, reply_id, local, text, text_length);
+
+    store->flags[slot] = flags & MESSAGE_COLLAPSED;
+
+    if (flags & MESSAGE_READ) {
+        message_store_mark_read(store, slot);
+    }
+
+    if (id > context->last_id) {
+        context->last_id = id;
+    }
+
+    return true;
+}
+
+// the folded root of the given id or MESSAGE_STORE_NONE, a followed thread gets the replies themselves
+static int32_t context_folded_root(struct context * context, long long root_id) {
+    struct message_store * store = &context->store;
+    int32_t root = message_store_find(store, root_id);
+
+    if (root == MESSAGE_STORE_NONE || store->parents[root] != MESSAGE_STORE_NONE ||
+        !(store->flags[root] & MESSAGE_COLLAPSED)) {
+        return MESSAGE_STORE_NONE;
+    }
+
+    return root;
+}
+
+static void context_add_activity(struct context * context, long long root_id, uint32_t replies) {
+    int32_t root = context_folded_root(context, root_id);
+
+    if (root != MESSAGE_STORE_NONE) {
+        context_thread(context, root)->activity += replies;
+        context->ui.dirty = true;
+    }
+}
+
+// a lazy history tells how many replies a thread has, the ones the client does not have are shown as activity
+static void context_add_summary(struct context * context, const struct protocol_thread * thread) {
+    struct message_store * store = &context->store;
+    int32_t root = context_folded_root(context, thread->root_id);
+
+    if (root == MESSAGE_STORE_NONE) {
+        return;
+    }
+
+    uint32_t known = store->subtree_sizes[root] - 1;
+
+    // the newest reply is already here, so nothing is missing
+    context_thread(context, root)->activity = thread->latest_id > store->latest_ids[root] && thread->replies > known ?
+                                              thread->replies - known : 0;
+    context->ui.dirty = true;
+}
+
+static void context_add_page(struct context * context, long long root_id, long long last_id) {
+    int32_t root = message_store_find(&context->store, root_id);
+
+    if (root != MESSAGE_STORE_NONE && !(context->store.flags[root] & MESSAGE_COLLAPSED)) {
+        context_thread(context, root)->next_page = last_id;
+        context->ui.dirty = true;
+    }
+}
+
+// a name announced by the server is interned locally, the ids of the server change with every connection
+static void context_add_author(struct context * context, uint32_t remote, const char * name, size_t name_length) {
+    if (remote >= context->remote_authors.capacity) {
+        size_t capacity = context->remote_authors.capacity ? context->remote_authors.capacity : 64;
+
+        while (capacity <= remote) {
+            capacity *= 2;
+        }
+
+        context->remote_authors.ids = realloc(context->remote_authors.ids, sizeof(uint32_t) * capacity);
+        memset(context->remote_authors.ids + context->remote_authors.capacity, 0,
+               sizeof(uint32_t) * (capacity - context->remote_authors.capacity));
+        context->remote_authors.capacity = capacity;
+    }
+
+    bool added;
+    context->remote_authors.ids[remote] = author_table_intern(&context->authors, name, name_length, &added);
+}
+
+static uint32_t context_local_author(struct context * context, uint32_t remote) {
+    return remote < context->remote_authors.capacity ? context->remote_authors.ids[remote] : AUTHOR_TABLE_NONE;
+}
+
+// the server has lost the messages the client has or has another history, they go and the history comes whole
+static void context_forget_history(struct context * context, uint64_t history_id) {
+    message_store_free(&context->store);
+    message_store_init(&context->store);
+
+    // the restored texts point into the cache, so it starts over only after the store
+    if (context->cached) {
+        history_cache_reset(&context->cache, history_id);
+    }
+
+    context->history_id = history_id;
 
-            continue;
+    free(context->threads.items);
+    context->threads.capacity = 0;
+    context->threads.items = NULL;
+
+    context->last_id = 0;
+    context->ui.top_id = 0;
+    context->ui.selected_id = 0;
+    context->ui.reply_id = 0;
+    context->ui.dirty = true;
+}
+
+// the welcome, then authors and messages, returns false if the connection has to be dropped
+static bool context_handle_frame(struct context * context, const struct protocol_frame * frame) {
+    if (!context->welcomed) {
+        struct protocol_welcome welcome;
+
+        context->welcomed = protocol_decode_welcome(frame, &welcome) && welcome.version == PROTOCOL_VERSION;
+
+        if (context->remote_authors.capacity > 0) {
+            memset(context->remote_authors.ids, 0, sizeof(uint32_t) * context->remote_authors.capacity);
+        }
+
+        if (!context->welcomed) {
+            return false;
+        }
+
+        // the server replays everything by the same rule
+        if (welcome.history_id != context->history_id || context->last_id > welcome.last_id) {
+            context_forget_history(context, welcome.history_id);
+        }
+
+        context_resubscribe(context);
+        return true;
+    }
+
+    if (frame->type == PROTOCOL_ACTIVITY) {
+        long long root_id;
+        uint32_t replies;
+
+        if (!protocol_decode_activity(frame, &root_id, &replies)) {
+            return false;
+        }
+
+        context_add_activity(context, root_id, replies);
+        return true;
+    }
+
+    if (frame->type == PROTOCOL_THREAD) {
+        struct protocol_thread thread;
+
+        if (!protocol_decode_thread(frame, &thread)) {
+            return false;
+        }
+
+        context_add_summary(context, &thread);
+        return true;
+    }
+
+    if (frame->type == PROTOCOL_MORE) {
+        long long root_id, last_id;
+
+        if (!protocol_decode_more(frame, &root_id, &last_id)) {
+            return false;
         }
 
-        read(context->socket, &reply_id, sizeof(reply_id));
+        context_add_page(context, root_id, last_id);
+        return true;
+    }
 
-        size_t username_length, message_length;
-        read(context->socket, &username_length, sizeof(username_length));
+    if (frame->type == PROTOCOL_AUTHOR) {
+        uint32_t remote;
+        const char * name;
+        size_t name_length;
 
-        char username[username_length + 1];
-        read(context->socket, username, username_length);
-        username[username_length] = '\0';
+        if (!protocol_decode_author(frame, &remote, &name, &name_length)) {
+            return false;
+        }
 
-        read(context->socket, &message_length, sizeof(message_length));
+        context_add_author(context, remote, name, name_length);
+        return true;
+    }
 
-        char message[message_length + 1];
-        read(context->socket, message, message_length);
-        message[message_length] = '\0';
+    struct protocol_message message;
 
-        context_add_message(context, id, reply_id, username, message);
+    if (!protocol_decode_message(frame, &message)) {
+        return false;
     }
 
-    pthread_exit(0);
+    char * text = message_store_alloc_text(&context->store, message.text_length);
+    memcpy(text, message.text, message.text_length);
+
+    context_add_message(context, message.id, message.reply_id, context_local_author(context, message.author),
+                        text, message.text_length);
+    return true;
 }
 
-static void run_server_handler(struct context * context) {
-    pthread_t tid; /* идентификатор потока */
-    pthread_attr_t attr; /* атрибуты потока */
+// takes whatever the socket has, a burst of messages is added in one go and drawn once
+static bool context_receive(struct context * context) {
+    size_t room;
+    char * space = protocol_reader_space(&context->received, &room);
+    ssize_t ret = read(context->socket, space, room);
+
+    if (ret < 0 && errno == EINTR) {
+        return true;
+    }
+
+    if (ret <= 0) {
+        return false;
+    }
+
+    protocol_reader_commit(&context->received, ret);
+
+    struct protocol_frame frame;
+    enum protocol_status status;
 
-/* получаем дефолтные значения атрибутов */
-    pthread_attr_init(&attr);
+    while ((status = protocol_reader_next(&context->received, &frame)) == PROTOCOL_FRAME) {
+        if (!context_handle_frame(context, &frame)) {
+            return false;
+        }
+    }
 
-/* создаем новый поток */
-    pthread_create(&tid, &attr, listen_to_server, context);
+    return status == PROTOCOL_INCOMPLETE;
 }
 
 static void context_send_message(struct context * context, const char * message) {
-    size_t username_length = strlen(context->username), message_length = strlen(message);
+    int32_t slot = message_store_find(&context->store, context->ui.reply_id);
 
-    write(context->socket, &context->ui.reply_id, sizeof(context->ui.reply_id));
-    write(context->socket, &username_length, sizeof(username_length));
-    write(context->socket, context->username, username_length);
-    write(context->socket, &message_length, sizeof(message_length));
-    write(context->socket, message, message_length);
-}
+    // a reply follows its thread, so the user sees the answers
+    if (slot != MESSAGE_STORE_NONE && (context->store.flags[context->store.roots[slot]] & MESSAGE_COLLAPSED)) {
+        context_toggle_thread(context, context->store.roots[slot]);
+    }
 
-static void handle_console(struct context * context) {
-    while (!context->stopping) {
-        int c = getc(stdin);
-
-        if (context->ui.writing) {
-            if (c == '\n') {
-                if (context->ui.input.length == 0) {
-                    context->ui.writing = false;
-                    context->ui.reply_id = 0;
-                    context_redraw_screen(context);
-                    continue;
-                }
+    size_t message_length = strlen(message);
+    size_t packet_length = protocol_post_length(context->ui.reply_id, message_length);
+    char * packet = malloc(packet_length);
 
-                char * buf = malloc(context->ui.input.length + 1);
-                memcpy(buf, context->ui.input.buffer, context->ui.input.length);
-                buf[context->ui.input.length] = '\0';
+    protocol_encode_post(packet, context->ui.reply_id, message, message_length);
 
-                context->ui.input.length = 0;
-                context->ui.writing = false;
-                context_redraw_screen(context);
+    if (context->socket >= 0) {
+        write(context->socket, packet, packet_length);
+    }
 
-                context_send_message(context, buf);
-                free(buf);
+    free(packet);
+}
 
+static void context_handle_key(struct context * context, int c) {
+    if (context->ui.writing) {
+        if (c == '\n') {
+            if (context->ui.input.length == 0) {
+                context->ui.writing = false;
                 context->ui.reply_id = 0;
-                continue;
+                context->ui.dirty = true;
+                return;
             }
 
-            if (c == '\177') {
-                if (context->ui.input.length > 0) {
-                    --context->ui.input.length;
-                    context_redraw_screen(context);
-                }
+            char * buf = malloc(context->ui.input.length + 1);
+            memcpy(buf, context->ui.input.buffer, context->ui.input.length);
+            buf[context->ui.input.length] = '\0';
+
+            context->ui.input.length = 0;
+            context->ui.writing = false;
+            context->ui.dirty = true;
+
+            context_send_message(context, buf);
+            free(buf);
+
+            context->ui.reply_id = 0;
+            return;
+        }
 
-                continue;
+        if (c == '\177') {
+            if (context->ui.input.length > 0) {
+                --context->ui.input.length;
+                context->ui.input_dirty = true;
             }
 
-            if (isprint(c) || c == ' ') {
-                if (context->ui.input.capacity == context->ui.input.length) {
-                    context->ui.input.capacity *= 2;
-                    context->ui.input.buffer = realloc(context->ui.input.buffer, context->ui.input.capacity);
-                }
+            return;
+        }
 
-                context->ui.input.buffer[context->ui.input.length++] = (char) c;
-                context_redraw_screen(context);
+        if (isprint(c) || c == ' ') {
+            if (context->ui.input.capacity == context->ui.input.length) {
+                context->ui.input.capacity *= 2;
+                context->ui.input.buffer = realloc(context->ui.input.buffer, context->ui.input.capacity);
             }
 
-            continue;
+            context->ui.input.buffer[context->ui.input.length++] = (char) c;
+            context->ui.input_dirty = true;
         }
 
-        switch (c) {
-            case 'q':
-                context->stopping = true;
-                break;
+        return;
+    }
 
-            case 'r':
-                context->ui.reply_id = context->ui.selected_id;
-                context->ui.writing = true;
-                context_redraw_screen(context);
-                break;
+    switch (c) {
+        case 'q':
+            context->stopping = true;
+            break;
 
-            case 'n':
-                context->ui.reply_id = 0;
-                context->ui.writing = true;
-                context_redraw_screen(context);
-                break;
+        case 'r':
+            context->ui.reply_id = context->ui.selected_id;
+            context->ui.writing = true;
+            context->ui.dirty = true;
+            break;
 
-            case 'c':
-            {
-                struct message * msg = message_find_by_id(context->messages, context->ui.selected_id);
-                if (msg) {
-                    msg->collapsed = !msg->collapsed;
-                    context_redraw_screen(context);
-                }
+        case 'n':
+            context->ui.reply_id = 0;
+            context->ui.writing = true;
+            context->ui.dirty = true;
+            break;
+
+        case 'c':
+        {
+            int32_t slot = message_store_find(&context->store, context->ui.selected_id);
+
+            if (slot != MESSAGE_STORE_NONE && context->store.parents[slot] == MESSAGE_STORE_NONE) {
+                context_toggle_thread(context, slot);
+                context->ui.dirty = true;
+            } else if (slot != MESSAGE_STORE_NONE) {
+                context->store.flags[slot] ^= MESSAGE_COLLAPSED;
+                context_flags_changed(context, slot);
+                context->ui.dirty = true;
+            }
 
+            break;
+        }
+
+        case 'w':
+            --context->ui.move;
+            context->ui.dirty = true;
+            break;
+
+        case 's':
+            ++context->ui.move;
+            context->ui.dirty = true;
+            break;
+
+        case 'a':
+            if (context->ui.left > 0) {
+                --context->ui.left;
+                context->ui.dirty = true;
+            }
+
+            break;
+
+        case 'd':
+            ++context->ui.left;
+            context->ui.dirty = true;
+            break;
+    }
+}
+
+// keys, messages and reconnects are handled in one loop, the screen is redrawn at most once per frame interval
+static void context_run(struct context * context) {
+    while (!context->stopping) {
+        struct pollfd fds[2] = {
+            {.fd = STDIN_FILENO, .events = POLLIN},
+            {.fd = context->socket, .events = POLLIN},
+        };
+        long long now = now_ms();
+        long long timeout = -1;
+
+        if (context->ui.dirty || context->ui.input_dirty) {
+            timeout = context->ui.last_frame + context->ui.frame_interval - now;
+            timeout = timeout > 0 ? timeout : 0;
+        }
+
+        if (context->socket < 0) {
+            long long wait = context->reconnect.at > now ? context->reconnect.at - now : 0;
+            timeout = timeout >= 0 && timeout < wait ? timeout : wait;
+        }
+
+        if (poll(fds, 2, (int) timeout) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if (fds[0].revents) {
+            char keys[256];
+            ssize_t count = read(STDIN_FILENO, keys, sizeof(keys));
+
+            if (count <= 0) {
                 break;
             }
 
-            case 'w':
-                context->ui.move = -1;
+            for (ssize_t i = 0; i < count && !context->stopping; ++i) {
+                context_handle_key(context, (unsigned char) keys[i]);
+            }
+        }
+
+        if (context->socket >= 0 && fds[1].revents && !context_receive(context)) {
+            context_connection_lost(context);
+        } else if (context->socket < 0 && !context->stopping && now_ms() >= context->reconnect.at) {
+            context_reconnect(context);
+        }
+
+        now = now_ms();
+
+        if ((context->ui.dirty || context->ui.input_dirty) && now - context->ui.last_frame >= context->ui.frame_interval) {
+            if (context->ui.dirty) {
                 context_redraw_screen(context);
+            } else {
+                context_redraw_input(context);
+            }
+
+            context->ui.dirty = false;
+            context->ui.input_dirty = false;
+            context->ui.last_frame = now;
+        }
+
+        // what arrived, was read or folded in this round is in the file before the next poll
+        if (context->cached) {
+            history_cache_flush(&context->cache);
+        }
+    }
+}
+
+static bool client_parse_options(int argc, char * argv[], struct context * context) {
+    int option;
+
+    context->ui.frame_interval = DEFAULT_FRAME_INTERVAL;
+    context->lazy = true;
+    context->cached = true;
+
+    while ((option = getopt(argc, argv, "f:an")) != -1) {
+        switch (option) {
+            case 'a':
+                context->lazy = false;
                 break;
 
-            case 's':
-                context->ui.move = 1;
-                context_redraw_screen(context);
+            case 'n':
+                context->cached = false;
                 break;
 
-            case 'a':
-                if (context->ui.left > 0) {
-                    --context->ui.left;
-                    context_redraw_screen(context);
+            case 'f':
+            {
+                char * end;
+                context->ui.frame_interval = strtoul(optarg, &end, 10);
+
+                if (*end != '\0') {
+                    printf("Bad frame interval: %s\n", optarg);
+                    return false;
                 }
 
                 break;
+            }
 
-            case 'd':
-                ++context->ui.left;
-                context_redraw_screen(context);
-                break;
+            default:
+                return false;
         }
     }
+
+    return argc - optind == 2;
 }
 
-int client_main(const char * username, const char * host) {
+int client_main(int argc, char * argv[]) {
     // specify an address for the socket
     struct context * context = malloc(sizeof(struct context));
+    context->last_id = 0;
+    context->history_id = 0;
+    srand((unsigned) time(NULL) ^ (unsigned) getpid());
+
+    if (!client_parse_options(argc, argv, context)) {
+        printf("Usage: c [-f frame interval in ms] [-a - whole history on join] [-n - no history cache] <username> <host>\n");
+        return 1;
+    }
+
+    const char * username = argv[optind], * host = argv[optind + 1];
+
+    if (strlen(username) == 0 || strlen(username) > PROTOCOL_MAX_AUTHOR_LENGTH) {
+        printf("Username has to be 1 to %d characters long\n", PROTOCOL_MAX_AUTHOR_LENGTH);
+        return 1;
+    }
+
+    // the hello of every connection registers the username
+    context->username = strdup(username);
 
     context->server_address.sin_family = AF_INET;
     context->server_address.sin_port = htons(9002);
@@ -482,18 +995,43 @@ int client_main(const char * username, const char * host) {
         return 1;
     }
 
-    // check for error with the connection
-    if (do_connect(context)) {
-        perror("There was an error making a connection to the remote socket");
-        return 2;
+    protocol_reader_init(&context->received, RECEIVE_BUFFER_SIZE);
+    author_table_init(&context->authors);
+    context->remote_authors.capacity = 0;
+    context->remote_authors.ids = NULL;
+
+    bool added;
+    context->own_author = author_table_intern(&context->authors, username, strlen(username), &added);
+    context->threads.capacity = 0;
+    context->threads.items = NULL;
+
+    message_store_init(&context->store);
+
+    // the cached history is on the screen with the first frame, the hello asks only for what came after it
+    char cache_path[4096];
+
+    if (context->cached) {
+        context->cached = history_cache_path(cache_path, sizeof(cache_path), host, 9002, username) &&
+                          history_cache_open(&context->cache, cache_path, context_restore_message, context);
     }
 
-    struct winsize w;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    // the welcome tells whether the cached messages still belong to the history of the server
+    if (context->cached) {
+        context->history_id = context->cache.history_id;
+    }
 
-    context->username = strdup(username);
+    context->socket = -1;
+    context->reconnect.attempts = 0;
+    context->reconnect.delay = 100;
+    context->reconnect.at = 0;
+
+    struct winsize w;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) || w.ws_row < 3 || w.ws_col == 0) {
+        w.ws_row = 24;
+        w.ws_col = 80;
+    }
 
-    context->ui.top = 0;
+    context->ui.top_id = 0;
     context->ui.left = 0;
     context->ui.width = w.ws_col;
     context->ui.height = w.ws_row;
@@ -501,27 +1039,54 @@ int client_main(const char * username, const char * host) {
     context->ui.selected_id = 0;
     context->ui.writing = false;
     context->ui.move = 0;
+    screen_init(&context->ui.screen, context->ui.width, context->ui.height);
+    context->ui.rows = malloc(sizeof(int32_t) * context->ui.height);
+    context->ui.last_frame = 0;
+    context->ui.dirty = true;
+    context->ui.input_dirty = false;
 
     context->ui.input.capacity = 256;
     context->ui.input.length = 0;
     context->ui.input.buffer = malloc(256);
 
-    context->messages = NULL;
     context->stopping = false;
 
     struct termios stored_settings = set_keypress();
 
+    // the cached history is on the screen before the server answers or even if it is unreachable,
+    // the first connection fails and is retried like any later one
     context_redraw_screen(context);
+    context->ui.dirty = false;
+    context->ui.last_frame = now_ms();
 
-    run_server_handler(context);
-    handle_console(context);
+    context_reconnect(context);
+    context_run(context);
 
     // and then close the socket
-    close(context->socket);
+    if (context->socket >= 0) {
+        close(context->socket);
+    }
 
     reset_keypress(stored_settings);
     printf(CSI"2J");
+
+    if (context->reconnect.attempts > RECONNECT_ATTEMPTS) {
+        printf("Cannot connect to remote host.\n");
+    }
+
     fflush(stdout);
 
+    if (context->cached) {
+        history_cache_close(&context->cache);
+    }
+
+    message_store_free(&context->store);
+    author_table_free(&context->authors);
+    free(context->remote_authors.ids);
+    free(context->threads.items);
+    screen_free(&context->ui.screen);
+    free(context->ui.rows);
+    protocol_reader_free(&context->received);
+
     return 0;
 }
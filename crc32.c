@@ -0,0 +1,32 @@
+#include <pthread.h>
+
+#include "crc32.h"
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_table(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; ++j) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+        }
+
+        crc32_table[i] = crc;
+    }
+}
+
+void crc32_init(void) {
+    pthread_once(&crc32_table_once, crc32_init_table);
+}
+
+uint32_t crc32_update(uint32_t crc, const void * data, size_t length) {
+    const unsigned char * bytes = data;
+
+    for (size_t i = 0; i < length; ++i) {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
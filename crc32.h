@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the crc32 of zlib: start from 0xFFFFFFFF, update with the data and invert the result
+void crc32_init(void);
+uint32_t crc32_update(uint32_t crc, const void * data, size_t length);
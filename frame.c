@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+
+struct frame * frame_new(size_t length) {
+    struct frame * frame = malloc(sizeof(struct frame) + length);
+
+    atomic_init(&frame->references, 1);
+    frame->control = false;
+    frame->length = length;
+
+    return frame;
+}
+
+struct frame * frame_ref(struct frame * frame) {
+    atomic_fetch_add_explicit(&frame->references, 1, memory_order_relaxed);
+    return frame;
+}
+
+void frame_unref(struct frame * frame) {
+    if (atomic_fetch_sub_explicit(&frame->references, 1, memory_order_acq_rel) == 1) {
+        free(frame);
+    }
+}
+
+void output_queue_init(struct output_queue * queue) {
+    queue->capacity = 0;
+    queue->head = 0;
+    queue->count = 0;
+    queue->slices = NULL;
+    queue->offset = 0;
+    queue->bytes = 0;
+    queue->pinned = 0;
+}
+
+void output_queue_push(struct output_queue * queue, struct frame * frame) {
+    struct frame_slice slice = {
+        .frame = frame,
+        .offset = 0,
+        .length = frame->length,
+    };
+
+    output_queue_push_slice(queue, slice);
+}
+
+void output_queue_push_slice(struct output_queue * queue, struct frame_slice slice) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+        struct frame_slice * slices = malloc(sizeof(struct frame_slice) * capacity);
+
+        for (size_t i = 0; i < queue->count; ++i) {
+            slices[i] = queue->slices[(queue->head + i) % queue->capacity];
+        }
+
+        free(queue->slices);
+        queue->slices = slices;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+
+    queue->slices[(queue->head + queue->count) % queue->capacity] = slice;
+    ++queue->count;
+    queue->bytes += slice.length;
+}
+
+static void output_queue_pop(struct output_queue * queue) {
+    frame_unref(queue->slices[queue->head].frame);
+
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    queue->offset = 0;
+}
+
+size_t output_queue_gather(struct output_queue * queue, struct iovec * iov, size_t max) {
+    size_t iov_count = 0;
+
+    for (size_t i = 0; i < queue->count && iov_count < max; ++i) {
+        struct frame_slice * slice = &queue->slices[(queue->head + i) % queue->capacity];
+        size_t skip = i == 0 ? queue->offset : 0;
+
+        iov[iov_count].iov_base = slice->frame->data + slice->offset + skip;
+        iov[iov_count].iov_len = slice->length - skip;
+        ++iov_count;
+    }
+
+    queue->pinned = iov_count;
+    return iov_count;
+}
+
+void output_queue_consume(struct output_queue * queue, size_t sent) {
+    queue->bytes -= sent;
+    queue->pinned = 0;
+
+    while (sent > 0) {
+        size_t left = queue->slices[queue->head].length - queue->offset;
+
+        if (sent < left) {
+            queue->offset += sent;
+            break;
+        }
+
+        sent -= left;
+        output_queue_pop(queue);
+    }
+}
+
+bool output_queue_flush(struct output_queue * queue, int socket) {
+    while (queue->count > 0) {
+        struct iovec iov[OUTPUT_QUEUE_IOVECS];
+
+        struct msghdr message = {
+            .msg_iov = iov,
+            .msg_iovlen = output_queue_gather(queue, iov, OUTPUT_QUEUE_IOVECS),
+        };
+
+        ssize_t ret = sendmsg(socket, &message, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            queue->pinned = 0;
+
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        output_queue_consume(queue, ret);
+    }
+
+    return true;
+}
+
+size_t output_queue_drop(struct output_queue * queue, size_t limit) {
+    size_t dropped = 0;
+
+    // a slice being sent has to be completed, otherwise the stream would be corrupted
+    size_t kept = queue->pinned > 0 ? queue->pinned : queue->offset > 0;
+    size_t count = kept;
+
+    // the slices that stay move forward over the dropped ones in their order
+    for (size_t i = kept; i < queue->count; ++i) {
+        struct frame_slice * slice = &queue->slices[(queue->head + i) % queue->capacity];
+
+        if (queue->bytes > limit && !slice->frame->control) {
+            queue->bytes -= slice->length;
+            frame_unref(slice->frame);
+            ++dropped;
+        } else if (dropped == 0) {
+            ++count;
+        } else {
+            queue->slices[(queue->head + count++) % queue->capacity] = *slice;
+        }
+    }
+
+    queue->count = count;
+    return dropped;
+}
+
+void output_queue_clear(struct output_queue * queue) {
+    while (queue->count > 0) {
+        output_queue_pop(queue);
+    }
+
+    queue->bytes = 0;
+}
+
+void output_queue_free(struct output_queue * queue) {
+    output_queue_clear(queue);
+    free(queue->slices);
+    output_queue_init(queue);
+}
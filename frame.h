@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// frames gathered by a single sendmsg
+#define OUTPUT_QUEUE_IOVECS 64
+
+// encoded frames shared by reference between the output queues of many connections,
+// bytes are never changed once some queue references them
+struct frame {
+    atomic_int references;
+    // protocol state the client cannot do without (welcome, authors, summaries, paging), never dropped
+    bool control;
+    size_t length;
+    char data[];
+};
+
+struct frame * frame_new(size_t length);
+struct frame * frame_ref(struct frame * frame);
+void frame_unref(struct frame * frame);
+
+// a range of a frame, several messages can live in one frame
+struct frame_slice {
+    struct frame * frame;
+    size_t offset;
+    size_t length;
+};
+
+// outgoing data of one connection, a ring of frame references
+struct output_queue {
+    size_t capacity;
+    size_t head;
+    size_t count;
+    struct frame_slice * slices;
+
+    size_t offset; // bytes of the head slice that are already sent
+    size_t bytes;  // bytes queued but not sent yet
+    size_t pinned; // slices at the head a send in progress reads, they are never dropped
+};
+
+void output_queue_init(struct output_queue * queue);
+// both take over the reference of the caller
+void output_queue_push(struct output_queue * queue, struct frame * frame);
+void output_queue_push_slice(struct output_queue * queue, struct frame_slice slice);
+// points iov at the unsent bytes of up to max slices from the head and pins them, returns the number of ranges
+size_t output_queue_gather(struct output_queue * queue, struct iovec * iov, size_t max);
+// releases the bytes the send of the gathered ranges has written and unpins the slices
+void output_queue_consume(struct output_queue * queue, size_t sent);
+// sends as much as the socket accepts, returns false if the socket failed
+bool output_queue_flush(struct output_queue * queue, int socket);
+// drops unsent message slices starting from the oldest until at most limit bytes stay queued, control frames stay;
+// returns the number of dropped slices
+size_t output_queue_drop(struct output_queue * queue, size_t limit);
+void output_queue_clear(struct output_queue * queue);
+void output_queue_free(struct output_queue * queue);
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "histogram.h"
+
+static size_t histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (size_t) value;
+    }
+
+    unsigned top = 63 - (unsigned) __builtin_clzll(value);
+    unsigned group = top - HISTOGRAM_SUB_BITS + 1;
+    uint64_t sub = (value >> (top - HISTOGRAM_SUB_BITS)) - HISTOGRAM_SUB_COUNT;
+
+    return ((size_t) group << HISTOGRAM_SUB_BITS) + (size_t) sub;
+}
+
+// the largest value that falls into the bucket
+static uint64_t histogram_bucket_limit(size_t index) {
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    unsigned group = (unsigned) (index >> HISTOGRAM_SUB_BITS);
+    uint64_t sub = index & (HISTOGRAM_SUB_COUNT - 1);
+
+    return ((HISTOGRAM_SUB_COUNT + sub + 1) << (group - 1)) - 1;
+}
+
+void histogram_init(struct histogram * histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+// only the recording thread writes, so a load and a store are enough
+void histogram_record(struct histogram * histogram, uint64_t value) {
+    size_t index = histogram_index(value);
+
+    STORE(histogram->buckets[index], LOAD(histogram->buckets[index]) + 1);
+    STORE(histogram->count, LOAD(histogram->count) + 1);
+    STORE(histogram->sum, LOAD(histogram->sum) + value);
+
+    if (value > LOAD(histogram->max)) {
+        STORE(histogram->max, value);
+    }
+}
+
+void histogram_merge(struct histogram * histogram, const struct histogram * other) {
+    uint64_t count = 0;
+
+    // the count is summed from the buckets, so percentiles stay consistent while the other one is recorded into
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        uint64_t bucket = LOAD(other->buckets[i]);
+
+        histogram->buckets[i] += bucket;
+        count += bucket;
+    }
+
+    histogram->count += count;
+    histogram->sum += LOAD(other->sum);
+
+    uint64_t max = LOAD(other->max);
+
+    if (max > histogram->max) {
+        histogram->max = max;
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram * histogram, double percentile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->count + 0.5);
+    uint64_t seen = 0;
+
+    rank = rank == 0 ? 1 : rank;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void histogram_print_json(FILE * file, const char * name, const struct histogram * histogram, double unit) {
+    fprintf(file, "\"%s\":{\"count\":%llu,\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}", name,
+            (unsigned long long) histogram->count,
+            histogram->count ? (double) histogram->sum / (double) histogram->count / unit : 0.0,
+            (double) histogram_percentile(histogram, 50) / unit, (double) histogram_percentile(histogram, 99) / unit,
+            (double) histogram_percentile(histogram, 99.9) / unit, (double) histogram->max / unit);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+/*
+ * Log-linear histogram in the manner of HdrHistogram: values below HISTOGRAM_SUB_COUNT are exact,
+ * every power of two above is split into HISTOGRAM_SUB_COUNT buckets, so any value is kept
+ * within about 3% of itself. Recording is a few instructions and never allocates.
+ * One thread records into a histogram, others may merge it into theirs at the same time:
+ * fields are updated with relaxed atomic stores that cost as much as plain ones.
+ */
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct histogram * histogram);
+void histogram_record(struct histogram * histogram, uint64_t value);
+void histogram_merge(struct histogram * histogram, const struct histogram * other);
+// the highest value equivalent to the one at the given percentile, 0 for an empty histogram
+uint64_t histogram_percentile(const struct histogram * histogram, double percentile);
+// "name":{"count":..,"mean":..,"p50":..,"p99":..,"p999":..,"max":..} with values divided by unit
+void histogram_print_json(FILE * file, const char * name, const struct histogram * histogram, double unit);
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "history_cache.h"
+
+#define HISTORY_CACHE_MAGIC "S265CCH2"
+#define HISTORY_CACHE_MAGIC_LENGTH 8
+#define HISTORY_CACHE_HEADER_LENGTH (HISTORY_CACHE_MAGIC_LENGTH + sizeof(uint64_t))
+#define HISTORY_CACHE_DIRECTORY "s265065"
+
+struct history_cache_record_header {
+    uint32_t checksum; // crc32 of the rest of the header after the flags and the payload
+    uint8_t flags;     // rewritten in place, so not covered by the checksum
+    uint8_t reserved[3];
+    int64_t id;
+    int64_t reply_id;
+    uint32_t author_length;
+    uint32_t text_length;
+};
+
+static uint32_t history_cache_record_checksum(const struct history_cache_record_header * header, const char * payload) {
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t covered = offsetof(struct history_cache_record_header, id);
+
+    crc = crc32_update(crc, (const char *) header + covered, sizeof(*header) - covered);
+    crc = crc32_update(crc, payload, (size_t) header->author_length + header->text_length + 1);
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static bool write_full(int fd, const char * data, size_t length) {
+    while (length > 0) {
+        ssize_t ret = write(fd, data, length);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return true;
+}
+
+bool history_cache_path(char * path, size_t size, const char * host, unsigned port, const char * username) {
+    const char * base = getenv("XDG_CACHE_HOME");
+    int length;
+
+    if (base && base[0] == '/') {
+        length = snprintf(path, size, "%s", base);
+    } else if ((base = getenv("HOME")) && base[0] != '\0') {
+        length = snprintf(path, size, "%s/.cache", base);
+        mkdir(path, 0700);
+    } else {
+        return false;
+    }
+
+    length += snprintf(path + length, size - length, "/" HISTORY_CACHE_DIRECTORY);
+
+    if (mkdir(path, 0700) && errno != EEXIST) {
+        return false;
+    }
+
+    length += snprintf(path + length, size - length, "/%s-%u-", host, port);
+
+    // the name becomes part of the file name, so only the harmless characters are kept
+    for (const char * c = username; *c && (size_t) length + 1 < size; ++c) {
+        path[length++] = isalnum((unsigned char) *c) || *c == '-' || *c == '.' ? *c : '_';
+    }
+
+    path[length] = '\0';
+    return (size_t) length + 1 < size;
+}
+
+static void history_cache_add_record(struct history_cache * cache, uint64_t offset, uint8_t flags) {
+    if (cache->records.count == cache->records.capacity) {
+        cache->records.capacity = cache->records.capacity ? cache->records.capacity * 2 : 1024;
+        cache->records.offsets = realloc(cache->records.offsets, sizeof(uint64_t) * cache->records.capacity);
+        cache->records.flags = realloc(cache->records.flags, cache->records.capacity);
+    }
+
+    cache->records.offsets[cache->records.count] = offset;
+    cache->records.flags[cache->records.count] = flags;
+    ++cache->records.count;
+}
+
+// restores the mapped records and returns the size of the intact prefix
+static size_t history_cache_restore(struct history_cache * cache, history_cache_restore_callback callback, void * param) {
+    size_t offset = HISTORY_CACHE_HEADER_LENGTH, size = cache->map_size;
+
+    while (size - offset >= sizeof(struct history_cache_record_header)) {
+        struct history_cache_record_header header;
+        memcpy(&header, cache->map + offset, sizeof(header));
+
+        size_t payload_length = (size_t) header.author_length + header.text_length + 1;
+        if (size - offset - sizeof(header) < payload_length) {
+            break;
+        }
+
+        char * author = cache->map + offset + sizeof(header);
+        char * text = author + header.author_length;
+
+        if (text[header.text_length] != '\0' || history_cache_record_checksum(&header, author) != header.checksum ||
+            !callback(param, header.id, header.reply_id, author, header.author_length, text, header.text_length,
+                      header.flags)) {
+            break;
+        }
+
+        history_cache_add_record(cache, offset, header.flags);
+        offset += sizeof(header) + payload_length;
+    }
+
+    return offset;
+}
+
+bool history_cache_open(struct history_cache * cache, const char * path,
+                        history_cache_restore_callback callback, void * param) {
+    cache->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (cache->fd < 0) {
+        return false;
+    }
+
+    // two clients appending to one file would interleave their records
+    if (flock(cache->fd, LOCK_EX | LOCK_NB)) {
+        close(cache->fd);
+        return false;
+    }
+
+    cache->map = NULL;
+    cache->map_size = 0;
+    cache->pending.capacity = 0;
+    cache->pending.length = 0;
+    cache->pending.buffer = NULL;
+    cache->records.count = 0;
+    cache->records.capacity = 0;
+    cache->records.offsets = NULL;
+    cache->records.flags = NULL;
+    cache->dirty.count = 0;
+    cache->dirty.capacity = 0;
+    cache->dirty.records = NULL;
+    cache->history_id = 0;
+
+    crc32_init();
+
+    struct stat st;
+    fstat(cache->fd, &st);
+
+    size_t size = st.st_size;
+
+    if (size >= HISTORY_CACHE_HEADER_LENGTH) {
+        cache->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, cache->fd, 0);
+
+        if (cache->map == MAP_FAILED) {
+            cache->map = NULL;
+        } else if (memcmp(cache->map, HISTORY_CACHE_MAGIC, HISTORY_CACHE_MAGIC_LENGTH) != 0) {
+            munmap(cache->map, size);
+            cache->map = NULL;
+        }
+    }
+
+    if (cache->map) {
+        cache->map_size = size;
+        madvise(cache->map, size, MADV_SEQUENTIAL);
+        memcpy(&cache->history_id, cache->map + HISTORY_CACHE_MAGIC_LENGTH, sizeof(cache->history_id));
+
+        size_t valid = history_cache_restore(cache, callback, param);
+
+        if (valid < size) {
+            ftruncate(cache->fd, (off_t) valid);
+        }
+
+        size = valid;
+    } else {
+        // an unknown or broken file is only a cache, it starts over
+        history_cache_reset(cache, 0);
+        size = HISTORY_CACHE_HEADER_LENGTH;
+    }
+
+    cache->size = size;
+    lseek(cache->fd, (off_t) size, SEEK_SET);
+
+    return true;
+}
+
+void history_cache_reset(struct history_cache * cache, uint64_t history_id) {
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+        cache->map_size = 0;
+    }
+
+    char header[HISTORY_CACHE_HEADER_LENGTH];
+    memcpy(header, HISTORY_CACHE_MAGIC, HISTORY_CACHE_MAGIC_LENGTH);
+    memcpy(header + HISTORY_CACHE_MAGIC_LENGTH, &history_id, sizeof(history_id));
+
+    ftruncate(cache->fd, 0);
+    lseek(cache->fd, 0, SEEK_SET);
+    write_full(cache->fd, header, sizeof(header));
+
+    cache->pending.length = 0;
+    cache->records.count = 0;
+    cache->dirty.count = 0;
+    cache->history_id = history_id;
+    cache->size = HISTORY_CACHE_HEADER_LENGTH;
+}
+
+void history_cache_append(struct history_cache * cache, long long id, long long reply_id,
+                          const char * author, size_t author_length,
+                          const char * text, size_t text_length, uint8_t flags) {
+    struct history_cache_record_header header;
+    memset(&header, 0, sizeof(header));
+
+    header.flags = flags;
+    header.id = id;
+    header.reply_id = reply_id;
+    header.author_length = (uint32_t) author_length;
+    header.text_length = (uint32_t) text_length;
+
+    size_t record_length = sizeof(header) + author_length + text_length + 1;
+
+    if (cache->pending.capacity - cache->pending.length < record_length) {
+        size_t capacity = cache->pending.capacity ? cache->pending.capacity : 64 * 1024;
+
+        while (capacity - cache->pending.length < record_length) {
+            capacity *= 2;
+        }
+
+        cache->pending.buffer = realloc(cache->pending.buffer, capacity);
+        cache->pending.capacity = capacity;
+    }
+
+    char * record = cache->pending.buffer + cache->pending.length;
+    memcpy(record + sizeof(header), author, author_length);
+    memcpy(record + sizeof(header) + author_length, text, text_length);
+    record[record_length - 1] = '\0';
+
+    header.checksum = history_cache_record_checksum(&header, record + sizeof(header));
+    memcpy(record, &header, sizeof(header));
+
+    history_cache_add_record(cache, cache->size, flags);
+
+    cache->pending.length += record_length;
+    cache->size += record_length;
+}
+
+void history_cache_set_flags(struct history_cache * cache, size_t record, uint8_t flags) {
+    if (record >= cache->records.count || cache->records.flags[record] == flags) {
+        return;
+    }
+
+    cache->records.flags[record] = flags;
+
+    // a pending record is written with its flags anyway
+    uint64_t written = cache->size - cache->pending.length;
+
+    if (cache->records.offsets[record] >= written) {
+        size_t at = cache->records.offsets[record] - written + offsetof(struct history_cache_record_header, flags);
+        cache->pending.buffer[at] = (char) flags;
+        return;
+    }
+
+    if (cache->dirty.count == cache->dirty.capacity) {
+        cache->dirty.capacity = cache->dirty.capacity ? cache->dirty.capacity * 2 : 64;
+        cache->dirty.records = realloc(cache->dirty.records, sizeof(size_t) * cache->dirty.capacity);
+    }
+
+    cache->dirty.records[cache->dirty.count++] = record;
+}
+
+void history_cache_flush(struct history_cache * cache) {
+    if (cache->pending.length > 0) {
+        write_full(cache->fd, cache->pending.buffer, cache->pending.length);
+        cache->pending.length = 0;
+    }
+
+    // a record listed twice gets the same byte twice
+    for (size_t i = 0; i < cache->dirty.count; ++i) {
+        size_t record = cache->dirty.records[i];
+
+        pwrite(cache->fd, &cache->records.flags[record], 1,
+               (off_t) (cache->records.offsets[record] + offsetof(struct history_cache_record_header, flags)));
+    }
+
+    cache->dirty.count = 0;
+}
+
+void history_cache_close(struct history_cache * cache) {
+    history_cache_flush(cache);
+
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+    }
+
+    free(cache->pending.buffer);
+    free(cache->records.offsets);
+    free(cache->records.flags);
+    free(cache->dirty.records);
+    close(cache->fd);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The client's copy of the history of one server, kept between runs.
+ *
+ * file:   <magic "S265CCH2"><history_id><record>*
+ * record: <checksum><flags><reserved><id><reply_id><author_length><text_length><author><text>\0
+ *
+ * Records are in the order the messages were added to the store, so the record of a message has its slot
+ * as index. The file stays mapped while the client runs and the texts of the restored messages point into it.
+ * New messages are collected in memory and appended with one write() per burst, the flags of written records
+ * are rewritten in place with the same flush. The checksum covers a record but its flags; the restore stops
+ * at the first record that is torn, damaged or refused and the rest of the file is cut off.
+ */
+
+// returns false if the record does not fit the records before it
+typedef bool (* history_cache_restore_callback)(void * param, long long id, long long reply_id,
+                                                const char * author, size_t author_length,
+                                                char * text, size_t text_length, uint8_t flags);
+
+struct history_cache {
+    int fd;
+
+    // the records of previous runs, read only
+    char * map;
+    size_t map_size;
+
+    struct {
+        size_t capacity;
+        size_t length;
+        char * buffer;
+    } pending;
+
+    // per record: where it starts in the file and the flags it has there
+    struct {
+        size_t count;
+        size_t capacity;
+        uint64_t * offsets;
+        uint8_t * flags;
+    } records;
+
+    // written records whose flags changed since the last flush
+    struct {
+        size_t count;
+        size_t capacity;
+        size_t * records;
+    } dirty;
+
+    uint64_t history_id; // of the server the records come from, 0 for a new file
+    uint64_t size; // of the file once the pending records are written
+};
+
+// the file of a server under $XDG_CACHE_HOME or ~/.cache, the directory is created if needed; returns false
+// if there is no place for it
+bool history_cache_path(char * path, size_t size, const char * host, unsigned port, const char * username);
+// opens or creates the cache and restores every record; fails if another client uses the file
+bool history_cache_open(struct history_cache * cache, const char * path,
+                        history_cache_restore_callback callback, void * param);
+// drops every record and starts over for another history; the texts that point into the file are gone afterwards
+void history_cache_reset(struct history_cache * cache, uint64_t history_id);
+void history_cache_append(struct history_cache * cache, long long id, long long reply_id,
+                          const char * author, size_t author_length,
+                          const char * text, size_t text_length, uint8_t flags);
+void history_cache_set_flags(struct history_cache * cache, size_t record, uint8_t flags);
+// writes the pending records and the changed flags
+void history_cache_flush(struct history_cache * cache);
+// flushes and closes the file, the texts that point into it are gone afterwards
+void history_cache_close(struct history_cache * cache);
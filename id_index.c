@@ -0,0 +1,42 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "id_index.h"
+
+void id_index_init(struct id_index * index) {
+    index->capacity = 0;
+    index->slots = NULL;
+}
+
+void id_index_put(struct id_index * index, long long id, size_t slot) {
+    if (id <= 0) {
+        return;
+    }
+
+    if ((size_t) id >= index->capacity) {
+        size_t capacity = index->capacity ? index->capacity : 1024;
+
+        while (capacity <= (size_t) id) {
+            capacity *= 2;
+        }
+
+        index->slots = realloc(index->slots, sizeof(size_t) * capacity);
+        memset(index->slots + index->capacity, 0, sizeof(size_t) * (capacity - index->capacity));
+        index->capacity = capacity;
+    }
+
+    index->slots[id] = slot + 1;
+}
+
+size_t id_index_get(const struct id_index * index, long long id) {
+    if (id <= 0 || (size_t) id >= index->capacity) {
+        return 0;
+    }
+
+    return index->slots[id];
+}
+
+void id_index_free(struct id_index * index) {
+    free(index->slots);
+    id_index_init(index);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+// dense id -> slot table, message ids are assigned sequentially starting from 1
+struct id_index {
+    size_t capacity;
+    size_t * slots; // slot + 1, 0 if there is no such id
+};
+
+void id_index_init(struct id_index * index);
+void id_index_put(struct id_index * index, long long id, size_t slot);
+// returns slot + 1 or 0 if the id is unknown
+size_t id_index_get(const struct id_index * index, long long id);
+void id_index_free(struct id_index * index);
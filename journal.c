@@ -0,0 +1,323 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+
+#include "crc32.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC "S265LOG2"
+#define JOURNAL_MAGIC_V1 "S265LOG1"
+#define JOURNAL_MAGIC_LENGTH 8
+#define JOURNAL_HEADER_LENGTH (JOURNAL_MAGIC_LENGTH + sizeof(uint64_t))
+
+struct journal_record_header {
+    uint32_t checksum; // crc32 of the rest of the header and the payload
+    uint32_t author_length;
+    uint32_t text_length;
+    uint32_t reserved;
+    int64_t id;
+    int64_t reply_id;
+};
+
+static uint32_t journal_record_checksum(const struct journal_record_header * header, const char * payload) {
+    uint32_t crc = 0xFFFFFFFFu;
+
+    crc = crc32_update(crc, (const char *) header + sizeof(header->checksum), sizeof(*header) - sizeof(header->checksum));
+    crc = crc32_update(crc, payload, (size_t) header->author_length + header->text_length);
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static bool write_full(int fd, const char * data, size_t length) {
+    while (length > 0) {
+        ssize_t ret = write(fd, data, length);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        data += ret;
+        length -= ret;
+    }
+
+    return true;
+}
+
+// replays the records of the mapped log that start at offset and returns the size of its intact prefix
+static size_t journal_replay(struct journal * journal, const char * data, size_t size, size_t offset,
+                             journal_replay_callback callback, void * param) {
+    while (size - offset >= sizeof(struct journal_record_header)) {
+        struct journal_record_header header;
+        memcpy(&header, data + offset, sizeof(header));
+
+        size_t payload_length = (size_t) header.author_length + header.text_length;
+        if (size - offset - sizeof(header) < payload_length) {
+            break;
+        }
+
+        const char * payload = data + offset + sizeof(header);
+        if (journal_record_checksum(&header, payload) != header.checksum) {
+            break;
+        }
+
+        if (journal->history_id == 0) {
+            journal->history_id = header.checksum | 1ULL << 32;
+        }
+
+        callback(param, header.id, header.reply_id, payload, header.author_length,
+                 payload + header.author_length, header.text_length);
+
+        ++journal->stats.records;
+        offset += sizeof(header) + payload_length;
+    }
+
+    return offset;
+}
+
+static void journal_sync_pending(struct journal * journal, char ** buffer, size_t * length) {
+    if (*length > 0) {
+        write_full(journal->fd, *buffer, *length);
+        fdatasync(journal->fd);
+
+        ++journal->stats.syncs;
+        *length = 0;
+    }
+}
+
+static void * journal_flusher(void * param) {
+    struct journal * journal = param;
+
+    size_t capacity = 0, length = 0;
+    char * buffer = NULL;
+
+    pthread_mutex_lock(&journal->lock);
+
+    while (!journal->closing || journal->pending.length > 0) {
+        if (journal->pending.length == 0) {
+            pthread_cond_wait(&journal->cond, &journal->lock);
+            continue;
+        }
+
+        // everything appended during the interval is committed together
+        if (!journal->closing) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+
+            deadline.tv_nsec += (long) journal->durability_interval * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            while (!journal->closing && pthread_cond_timedwait(&journal->cond, &journal->lock, &deadline) != ETIMEDOUT);
+        }
+
+        // swap the buffers so appends can go on while the batch is written
+        char * pending_buffer = journal->pending.buffer;
+        size_t pending_capacity = journal->pending.capacity;
+
+        journal->pending.buffer = buffer;
+        journal->pending.capacity = capacity;
+        buffer = pending_buffer;
+        capacity = pending_capacity;
+        length = journal->pending.length;
+        journal->pending.length = 0;
+
+        pthread_mutex_unlock(&journal->lock);
+        journal_sync_pending(journal, &buffer, &length);
+        pthread_mutex_lock(&journal->lock);
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+// writes the header of an empty log with a new history id, returns its size
+static size_t journal_create(struct journal * journal) {
+    char header[JOURNAL_HEADER_LENGTH];
+
+    while (journal->history_id == 0) {
+        getrandom(&journal->history_id, sizeof(journal->history_id), 0);
+    }
+
+    memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+    memcpy(header + JOURNAL_MAGIC_LENGTH, &journal->history_id, sizeof(journal->history_id));
+
+    ftruncate(journal->fd, 0);
+    lseek(journal->fd, 0, SEEK_SET);
+    write_full(journal->fd, header, JOURNAL_HEADER_LENGTH);
+    fdatasync(journal->fd);
+
+    return JOURNAL_HEADER_LENGTH;
+}
+
+bool journal_open(struct journal * journal, const char * path, unsigned durability_interval,
+                  journal_replay_callback callback, void * param) {
+    crc32_init();
+
+    journal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (journal->fd < 0) {
+        return false;
+    }
+
+    journal->durability_interval = durability_interval;
+    journal->closing = false;
+    journal->pending.capacity = 0;
+    journal->pending.length = 0;
+    journal->pending.buffer = NULL;
+    memset(&journal->stats, 0, sizeof(journal->stats));
+
+    struct stat st;
+    fstat(journal->fd, &st);
+
+    size_t size = st.st_size;
+
+    journal->history_id = 0;
+
+    if (size == 0) {
+        size = journal_create(journal);
+    } else {
+        if (size < JOURNAL_MAGIC_LENGTH) {
+            close(journal->fd);
+            return false;
+        }
+
+        char * data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, journal->fd, 0);
+        if (data == MAP_FAILED) {
+            close(journal->fd);
+            return false;
+        }
+
+        size_t start;
+
+        if (memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) == 0) {
+            start = JOURNAL_HEADER_LENGTH;
+
+            if (size >= start) {
+                memcpy(&journal->history_id, data + JOURNAL_MAGIC_LENGTH, sizeof(journal->history_id));
+            }
+        } else if (memcmp(data, JOURNAL_MAGIC_V1, JOURNAL_MAGIC_LENGTH) == 0) {
+            start = JOURNAL_MAGIC_LENGTH;
+        } else {
+            munmap(data, size);
+            close(journal->fd);
+            return false;
+        }
+
+        madvise(data, size, MADV_SEQUENTIAL);
+
+        size_t valid = size >= start ? journal_replay(journal, data, size, start, callback, param) : 0;
+        munmap(data, size);
+
+        // a torn header or an old log without records has nothing to keep, it starts over in the current format
+        if (journal->history_id == 0) {
+            journal->stats.truncated_bytes = size - (valid > 0 ? start : 0);
+            size = journal_create(journal);
+        } else {
+            if (valid < size) {
+                journal->stats.truncated_bytes = size - valid;
+                ftruncate(journal->fd, (off_t) valid);
+                fdatasync(journal->fd);
+            }
+
+            size = valid;
+        }
+    }
+
+    journal->stats.bytes = size;
+    lseek(journal->fd, (off_t) size, SEEK_SET);
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+
+    if (durability_interval > 0) {
+        pthread_create(&journal->flusher, NULL, journal_flusher, journal);
+    }
+
+    return true;
+}
+
+void journal_append(struct journal * journal, long long id, long long reply_id,
+                    const char * author, size_t author_length,
+                    const char * text, size_t text_length) {
+    struct journal_record_header header;
+
+    header.author_length = (uint32_t) author_length;
+    header.text_length = (uint32_t) text_length;
+    header.reserved = 0;
+    header.id = id;
+    header.reply_id = reply_id;
+
+    size_t record_length = sizeof(header) + author_length + text_length;
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (journal->pending.capacity - journal->pending.length < record_length) {
+        size_t capacity = journal->pending.capacity ? journal->pending.capacity : 64 * 1024;
+
+        while (capacity - journal->pending.length < record_length) {
+            capacity *= 2;
+        }
+
+        journal->pending.buffer = realloc(journal->pending.buffer, capacity);
+        journal->pending.capacity = capacity;
+    }
+
+    char * record = journal->pending.buffer + journal->pending.length;
+    memcpy(record + sizeof(header), author, author_length);
+    memcpy(record + sizeof(header) + author_length, text, text_length);
+
+    header.checksum = journal_record_checksum(&header, record + sizeof(header));
+    memcpy(record, &header, sizeof(header));
+
+    journal->pending.length += record_length;
+    ++journal->stats.records;
+    journal->stats.bytes += record_length;
+
+    // the flusher only sleeps without a deadline while nothing is pending, later appends wait for its interval
+    if (journal->durability_interval > 0 && journal->pending.length == record_length) {
+        pthread_cond_signal(&journal->cond);
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_commit(struct journal * journal) {
+    if (journal->durability_interval > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    journal_sync_pending(journal, &journal->pending.buffer, &journal->pending.length);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_close(struct journal * journal) {
+    pthread_mutex_lock(&journal->lock);
+    journal->closing = true;
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->lock);
+
+    if (journal->durability_interval > 0) {
+        pthread_join(journal->flusher, NULL);
+    }
+
+    journal_sync_pending(journal, &journal->pending.buffer, &journal->pending.length);
+
+    free(journal->pending.buffer);
+    close(journal->fd);
+
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->cond);
+}
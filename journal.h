@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Append-only message log.
+ *
+ * file:   <magic "S265LOG2"><history id><record>*
+ * record: <checksum><id><reply_id><author_length><text_length><author><text>
+ *
+ * Appends are collected in memory and written with one write() and fdatasync() per durability
+ * interval by a background thread (group commit). With an interval of 0 the appends are written and
+ * synced together by journal_commit, which the owner calls before the messages become visible.
+ *
+ * The history id is made when the log is created and names its history for clients, a log of the first
+ * format "S265LOG1" has no header and takes the checksum of its first record instead.
+ */
+
+typedef void (* journal_replay_callback)(void * param, long long id, long long reply_id,
+                                         const char * author, size_t author_length,
+                                         const char * text, size_t text_length);
+
+struct journal_stats {
+    size_t records;
+    size_t bytes;
+    size_t syncs;
+    size_t truncated_bytes; // torn tail cut off by the last recovery
+};
+
+struct journal {
+    int fd;
+    unsigned durability_interval; // milliseconds
+    uint64_t history_id;          // never 0
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t flusher;
+    bool closing;
+
+    struct {
+        size_t capacity;
+        size_t length;
+        char * buffer;
+    } pending;
+
+    struct journal_stats stats;
+};
+
+// opens or creates the log and replays every intact record, a torn or corrupted tail is truncated
+bool journal_open(struct journal * journal, const char * path, unsigned durability_interval,
+                  journal_replay_callback callback, void * param);
+void journal_append(struct journal * journal, long long id, long long reply_id,
+                    const char * author, size_t author_length,
+                    const char * text, size_t text_length);
+// writes and syncs everything appended so far if the durability interval is 0, the flusher does it otherwise
+void journal_commit(struct journal * journal);
+// flushes everything pending and closes the file
+void journal_close(struct journal * journal);
@@ -0,0 +1,783 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "histogram.h"
+
+#define MAX_EVENTS 256
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+#define RECENT_MESSAGES 256
+#define HISTORY_BATCH 1000
+#define MAX_POST_BURST 1000
+#define JOIN_TIMEOUT 120
+#define MAX_TEXT_LENGTH 4096
+
+/*
+ * Load generator: headless clients speaking the real protocol.
+ *
+ * 1. the history client posts the given number of messages and waits for a marker post,
+ *    the id of the marker is where the history ends;
+ * 2. the clients connect, every one is joined once it has received the history up to the marker;
+ * 3. the clients post at the given total rate for the given time, replies build trees of bounded depth;
+ *    every text starts with the send time, so each delivery gives an end-to-end fan-out latency sample;
+ *    new threads reach every client, replies only the ones following every thread, the others count activity frames;
+ * 4. posting stops and in-flight messages are drained.
+ *
+ * The sender and the receivers share the monotonic clock, so the generator must run on one host.
+ */
+
+enum load_phase {
+    LOAD_CONNECT,
+    LOAD_RUN,
+    LOAD_DRAIN,
+    LOAD_STOP,
+};
+
+struct load_options {
+    struct sockaddr_in address;
+    size_t clients;
+    size_t workers;
+    double rate;          // posts per second of all clients together
+    double duration;      // seconds
+    double drain;         // seconds
+    size_t history;
+    size_t text_length;
+    unsigned reply_percent;
+    unsigned max_depth;
+    unsigned follow_percent; // clients subscribed to every thread, the first client of a worker always is
+    bool lazy;               // clients join with thread summaries instead of the whole history
+    const char * output_path;
+};
+
+struct load_client {
+    int socket;
+    struct protocol_reader input;
+    long long connected_at;
+    bool joined;
+};
+
+// a message of the run the observer has seen, replies are posted to them
+struct load_recent {
+    long long id;
+    unsigned depth;
+};
+
+struct load_worker {
+    struct load_shared * shared;
+    pthread_t thread;
+    unsigned seed;
+
+    size_t first;
+    size_t count;
+    struct load_client * clients;
+    int epoll;
+
+    // the first client of the worker also follows the shape of the trees
+    struct load_recent recent[RECENT_MESSAGES];
+    size_t recent_count;
+
+    size_t posted;
+    size_t replies;           // posted ones
+    size_t activity;          // activity frames received
+    size_t delivered;
+    size_t bytes;
+    size_t failed;
+    struct histogram latency; // nanoseconds from the post to the delivery
+    struct histogram join;    // nanoseconds from connecting to having the whole history
+};
+
+struct load_shared {
+    struct load_options options;
+    long long history_end;
+
+    atomic_int phase;
+    atomic_size_t connected;
+    atomic_size_t followers;  // connected clients following every thread
+    atomic_size_t joined;
+    long long run_start;
+};
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleep_ns(long long duration) {
+    struct timespec ts = {.tv_sec = duration / 1000000000LL, .tv_nsec = duration % 1000000000LL};
+
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static bool write_all(int socket, const char * data, size_t length) {
+    while (length > 0) {
+        ssize_t ret = send(socket, data, length, 0);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        data += ret;
+        length -= (size_t) ret;
+    }
+
+    return true;
+}
+
+// the socket stays blocking for writes so a post always goes out whole, reads use MSG_DONTWAIT
+static int load_connect(const struct load_options * options, const char * username, bool follow) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int nodelay = 1;
+    char hello[PROTOCOL_HELLO_LENGTH + PROTOCOL_SUBSCRIBE_LENGTH];
+    size_t hello_length = protocol_encode_hello(hello, 0, username, strlen(username), options->lazy ? PROTOCOL_HELLO_LAZY : 0, 0);
+
+    // a subscription to root 0 follows every thread
+    if (follow) {
+        hello_length += protocol_encode_subscribe(hello + hello_length, 0, true);
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (connect(fd, (const struct sockaddr *) &options->address, sizeof(options->address)) ||
+        !write_all(fd, hello, hello_length)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// the text starts with a tag and the send time, the rest is padding up to the text length
+static size_t load_encode_post(char * buffer, const struct load_options * options, char tag, long long reply_id) {
+    char text[MAX_TEXT_LENGTH];
+    size_t length = (size_t) snprintf(text, sizeof(text), "%c%lld ", tag, now_ns());
+
+    if (options->text_length > length) {
+        memset(text + length, 'x', options->text_length - length);
+        length = options->text_length;
+    }
+
+    return protocol_encode_post(buffer, reply_id, text, length);
+}
+
+// reads what the history client has got, returns the id of the marker, 0 if it has not come yet or -1 on errors
+static long long load_read_marker(int fd, struct protocol_reader * reader, const char * marker, size_t marker_length, int flags) {
+    size_t room;
+    char * space = protocol_reader_space(reader, &room);
+    ssize_t ret = recv(fd, space, room, flags);
+
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+
+    if (ret <= 0) {
+        return -1;
+    }
+
+    protocol_reader_commit(reader, (size_t) ret);
+
+    struct protocol_frame frame;
+    struct protocol_message message;
+    long long id = 0;
+
+    while (protocol_reader_next(reader, &frame) == PROTOCOL_FRAME) {
+        if (protocol_decode_message(&frame, &message) && message.text_length == marker_length &&
+            memcmp(message.text, marker, marker_length) == 0) {
+            id = message.id;
+        }
+    }
+
+    return id;
+}
+
+// fills the server with history and returns the id of the marker that ends it; nobody else posts meanwhile,
+// so the history messages get consecutive ids after the first one and replies can refer to them
+static long long load_fill_history(const struct load_options * options) {
+    int fd = load_connect(options, "load-history", false);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct protocol_reader reader;
+    char * batch = malloc(protocol_post_length(0, MAX_TEXT_LENGTH) * HISTORY_BATCH);
+    char marker[32];
+    size_t marker_length = (size_t) snprintf(marker, sizeof(marker), "S%lld", now_ns());
+    unsigned seed = (unsigned) now_ns();
+    long long first = 0, end = 0;
+
+    protocol_reader_init(&reader, RECEIVE_BUFFER_SIZE);
+
+    // the first message is a marker too, it tells where the ids of the history start
+    if (!write_all(fd, batch, protocol_encode_post(batch, 0, marker, marker_length))) {
+        first = -1;
+    }
+
+    while (first == 0) {
+        first = load_read_marker(fd, &reader, marker, marker_length, 0);
+    }
+
+    if (first < 0) {
+        end = -1;
+    }
+
+    marker_length = (size_t) snprintf(marker, sizeof(marker), "E%lld", now_ns());
+
+    for (size_t posted = 1; end == 0 && posted < options->history;) {
+        size_t count = options->history - posted < HISTORY_BATCH ? options->history - posted : HISTORY_BATCH;
+        size_t length = 0;
+
+        // replies of the history go to random earlier messages of it, so it has threads for lazy joins to skip
+        for (size_t i = 0; i < count; ++i) {
+            long long reply_id = (unsigned) rand_r(&seed) % 100 < options->reply_percent ?
+                                 first + (long long) ((size_t) rand_r(&seed) % (posted + i)) : 0;
+
+            length += load_encode_post(batch + length, options, 'H', reply_id);
+        }
+
+        posted += count;
+
+        // echoes are read between batches, so the server never has to hold many of them for us
+        if (!write_all(fd, batch, length) || load_read_marker(fd, &reader, marker, marker_length, MSG_DONTWAIT) < 0) {
+            end = -1;
+        }
+    }
+
+    // the marker is the last message of the history, its text is unique to this run
+    if (end == 0 && !write_all(fd, batch, protocol_encode_post(batch, 0, marker, marker_length))) {
+        end = -1;
+    }
+
+    while (end == 0) {
+        end = load_read_marker(fd, &reader, marker, marker_length, 0);
+    }
+
+    protocol_reader_free(&reader);
+    free(batch);
+    close(fd);
+
+    return end;
+}
+
+static void load_client_joined(struct load_worker * worker, struct load_client * client) {
+    client->joined = true;
+
+    histogram_record(&worker->join, (uint64_t) (now_ns() - client->connected_at));
+    atomic_fetch_add(&worker->shared->joined, 1);
+}
+
+// the depth of a message among the recent ones, replies to unknown messages count as roots
+static unsigned load_depth(const struct load_worker * worker, long long reply_id) {
+    for (size_t i = 0; reply_id && i < worker->recent_count; ++i) {
+        if (worker->recent[i].id == reply_id) {
+            return worker->recent[i].depth + 1;
+        }
+    }
+
+    return 0;
+}
+
+static void load_handle_message(struct load_worker * worker, size_t index, const struct protocol_message * message) {
+    struct load_shared * shared = worker->shared;
+    struct load_client * client = &worker->clients[index];
+
+    if (!client->joined && message->id >= shared->history_end) {
+        load_client_joined(worker, client);
+    }
+
+    if (message->text_length < 2 || message->text[0] != 'T' || atomic_load(&shared->phase) < LOAD_RUN) {
+        return;
+    }
+
+    char stamp[24];
+    size_t length = message->text_length - 1 < sizeof(stamp) - 1 ? message->text_length - 1 : sizeof(stamp) - 1;
+
+    memcpy(stamp, message->text + 1, length);
+    stamp[length] = '\0';
+
+    long long sent = atoll(stamp);
+
+    // posts of an earlier run replayed as history are not deliveries of this one
+    if (sent < shared->run_start) {
+        return;
+    }
+
+    histogram_record(&worker->latency, (uint64_t) (now_ns() - sent));
+    ++worker->delivered;
+
+    if (index == 0) {
+        struct load_recent * recent = &worker->recent[worker->recent_count < RECENT_MESSAGES ? worker->recent_count++ :
+                                                      (size_t) message->id % RECENT_MESSAGES];
+
+        recent->depth = load_depth(worker, message->reply_id);
+        recent->id = message->id;
+    }
+}
+
+// drains the socket, returns false if the connection is gone
+static bool load_receive(struct load_worker * worker, size_t index) {
+    struct load_client * client = &worker->clients[index];
+
+    while (true) {
+        size_t room;
+        char * space = protocol_reader_space(&client->input, &room);
+        ssize_t ret = recv(client->socket, space, room, MSG_DONTWAIT);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        protocol_reader_commit(&client->input, (size_t) ret);
+        worker->bytes += (size_t) ret;
+
+        struct protocol_frame frame;
+        struct protocol_message message;
+        enum protocol_status status;
+
+        while ((status = protocol_reader_next(&client->input, &frame)) == PROTOCOL_FRAME) {
+            if (frame.type == PROTOCOL_WELCOME) {
+                if (!client->joined && worker->shared->history_end == 0) {
+                    load_client_joined(worker, client);
+                }
+            } else if (frame.type == PROTOCOL_MESSAGE && protocol_decode_message(&frame, &message)) {
+                load_handle_message(worker, index, &message);
+            } else if (frame.type == PROTOCOL_ACTIVITY && atomic_load(&worker->shared->phase) >= LOAD_RUN) {
+                ++worker->activity;
+            }
+        }
+
+        if (status == PROTOCOL_MALFORMED) {
+            return false;
+        }
+    }
+}
+
+// a random client of the worker posts a new thread or a reply to a recent message that is not too deep
+static void load_post(struct load_worker * worker, char * buffer) {
+    const struct load_options * options = &worker->shared->options;
+    struct load_client * client = &worker->clients[(size_t) rand_r(&worker->seed) % worker->count];
+    long long reply_id = 0;
+
+    if (client->socket < 0) {
+        ++worker->failed;
+        return;
+    }
+
+    if (worker->recent_count > 0 && (unsigned) rand_r(&worker->seed) % 100 < options->reply_percent) {
+        const struct load_recent * recent = &worker->recent[(size_t) rand_r(&worker->seed) % worker->recent_count];
+
+        if (recent->depth + 1 < options->max_depth) {
+            reply_id = recent->id;
+        }
+    }
+
+    size_t length = load_encode_post(buffer, options, 'T', reply_id);
+
+    if (write_all(client->socket, buffer, length)) {
+        ++worker->posted;
+        worker->replies += reply_id != 0;
+    } else {
+        ++worker->failed;
+    }
+}
+
+static void * load_worker_run(void * param) {
+    struct load_worker * worker = param;
+    struct load_shared * shared = worker->shared;
+    const struct load_options * options = &shared->options;
+    char * post = malloc(protocol_post_length(0, MAX_TEXT_LENGTH));
+    struct epoll_event events[MAX_EVENTS];
+
+    worker->epoll = epoll_create1(0);
+
+    for (size_t i = 0; i < worker->count; ++i) {
+        struct load_client * client = &worker->clients[i];
+        char username[32];
+        // the first client follows the shape of the trees, so it needs every reply; the others are spread evenly,
+        // follow_percent of every 100 consecutive clients of a worker follow
+        bool follow = i == 0 || (i * options->follow_percent) % 100 < options->follow_percent;
+
+        snprintf(username, sizeof(username), "load%zu", worker->first + i);
+
+        protocol_reader_init(&client->input, RECEIVE_BUFFER_SIZE);
+        client->joined = false;
+        client->connected_at = now_ns();
+        client->socket = load_connect(options, username, follow);
+
+        if (client->socket < 0) {
+            ++worker->failed;
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(worker->epoll, EPOLL_CTL_ADD, client->socket, &event);
+
+        atomic_fetch_add(&shared->connected, 1);
+
+        if (follow) {
+            atomic_fetch_add(&shared->followers, 1);
+        }
+    }
+
+    // posts are spread evenly over the run, the rate of a worker is its share of the total
+    double rate = options->rate / (double) options->workers;
+    enum load_phase phase;
+
+    while ((phase = atomic_load(&shared->phase)) != LOAD_STOP) {
+        int timeout = 10;
+
+        if (phase == LOAD_RUN) {
+            double due = (double) (now_ns() - shared->run_start) / 1e9 * rate - (double) worker->posted;
+            size_t count = due > MAX_POST_BURST ? MAX_POST_BURST : (size_t) (due > 0 ? due : 0);
+
+            for (size_t i = 0; i < count; ++i) {
+                load_post(worker, post);
+            }
+
+            timeout = 1;
+        }
+
+        int count = epoll_wait(worker->epoll, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < count; ++i) {
+            size_t index = (size_t) events[i].data.u64;
+            struct load_client * client = &worker->clients[index];
+
+            if (!load_receive(worker, index)) {
+                epoll_ctl(worker->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+                close(client->socket);
+                client->socket = -1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < worker->count; ++i) {
+        if (worker->clients[i].socket >= 0) {
+            close(worker->clients[i].socket);
+        }
+
+        protocol_reader_free(&worker->clients[i].input);
+    }
+
+    close(worker->epoll);
+    free(post);
+
+    return NULL;
+}
+
+static bool load_parse_size(const char * text, size_t * value) {
+    char * end;
+    *value = strtoul(text, &end, 10);
+
+    return *end == '\0';
+}
+
+static bool load_parse_double(const char * text, double * value) {
+    char * end;
+    *value = strtod(text, &end);
+
+    return *end == '\0' && *value >= 0;
+}
+
+static bool load_parse_options(int argc, char * argv[], struct load_options * options) {
+    int option;
+    size_t value;
+
+    options->clients = 100;
+    options->workers = 1;
+    options->rate = 100;
+    options->duration = 10;
+    options->drain = 1;
+    options->history = 0;
+    options->text_length = 64;
+    options->reply_percent = 50;
+    options->max_depth = 8;
+    options->follow_percent = 100;
+    options->lazy = false;
+    options->output_path = NULL;
+
+    while ((option = getopt(argc, argv, "c:w:r:t:D:H:l:p:d:f:Lo:")) != -1) {
+        switch (option) {
+            case 'c':
+                if (!load_parse_size(optarg, &options->clients) || options->clients == 0) {
+                    return false;
+                }
+
+                break;
+
+            case 'w':
+                if (!load_parse_size(optarg, &options->workers) || options->workers == 0) {
+                    return false;
+                }
+
+                break;
+
+            case 'r':
+                if (!load_parse_double(optarg, &options->rate)) {
+                    return false;
+                }
+
+                break;
+
+            case 't':
+                if (!load_parse_double(optarg, &options->duration)) {
+                    return false;
+                }
+
+                break;
+
+            case 'D':
+                if (!load_parse_double(optarg, &options->drain)) {
+                    return false;
+                }
+
+                break;
+
+            case 'H':
+                if (!load_parse_size(optarg, &options->history)) {
+                    return false;
+                }
+
+                break;
+
+            case 'l':
+                if (!load_parse_size(optarg, &options->text_length) || options->text_length > MAX_TEXT_LENGTH) {
+                    return false;
+                }
+
+                break;
+
+            case 'p':
+                if (!load_parse_size(optarg, &value) || value > 100) {
+                    return false;
+                }
+
+                options->reply_percent = (unsigned) value;
+                break;
+
+            case 'd':
+                if (!load_parse_size(optarg, &value) || value == 0) {
+                    return false;
+                }
+
+                options->max_depth = (unsigned) value;
+                break;
+
+            case 'f':
+                if (!load_parse_size(optarg, &value) || value > 100) {
+                    return false;
+                }
+
+                options->follow_percent = (unsigned) value;
+                break;
+
+            case 'L':
+                options->lazy = true;
+                break;
+
+            case 'o':
+                options->output_path = optarg;
+                break;
+
+            default:
+                return false;
+        }
+    }
+
+    if (options->workers > options->clients) {
+        options->workers = options->clients;
+    }
+
+    if (argc - optind != 1) {
+        return false;
+    }
+
+    options->address.sin_family = AF_INET;
+    options->address.sin_port = htons(9002);
+
+    return inet_aton(argv[optind], &options->address.sin_addr) != 0;
+}
+
+// every client needs a descriptor
+static void load_raise_file_limit(size_t clients) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < clients + 64) {
+        limit.rlim_cur = clients + 64 < limit.rlim_max ? clients + 64 : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char * argv[]) {
+    struct load_shared * shared = malloc(sizeof(struct load_shared));
+    struct load_options * options = &shared->options;
+
+    if (!load_parse_options(argc, argv, options)) {
+        printf("Usage: %s [-c clients] [-w worker threads] [-r posts per second] [-t seconds] [-D drain seconds]\n"
+               "          [-H history messages] [-l text length] [-p reply percent] [-d max depth] [-f following percent]\n"
+               "          [-L - lazy join] [-o results file] <host>\n",
+               argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    load_raise_file_limit(options->clients);
+
+    atomic_init(&shared->phase, LOAD_CONNECT);
+    atomic_init(&shared->connected, 0);
+    atomic_init(&shared->followers, 0);
+    atomic_init(&shared->joined, 0);
+    shared->run_start = 0;
+    shared->history_end = 0;
+
+    long long start = now_ns();
+
+    if (options->history > 0) {
+        shared->history_end = load_fill_history(options);
+
+        if (shared->history_end < 0) {
+            printf("Cannot fill the history\n");
+            return 2;
+        }
+    }
+
+    double fill_time = (double) (now_ns() - start) / 1e9;
+
+    struct load_worker * workers = calloc(options->workers, sizeof(struct load_worker));
+    size_t first = 0;
+
+    start = now_ns();
+
+    for (size_t i = 0; i < options->workers; ++i) {
+        struct load_worker * worker = &workers[i];
+
+        worker->shared = shared;
+        worker->seed = (unsigned) (start ^ (long long) i * 7919);
+        worker->first = first;
+        worker->count = options->clients / options->workers + (i < options->clients % options->workers ? 1 : 0);
+        worker->clients = calloc(worker->count, sizeof(struct load_client));
+        histogram_init(&worker->latency);
+        histogram_init(&worker->join);
+
+        first += worker->count;
+
+        pthread_create(&worker->thread, NULL, load_worker_run, worker);
+    }
+
+    // everyone has the history before the first post
+    while (atomic_load(&shared->joined) < options->clients && now_ns() - start < JOIN_TIMEOUT * 1000000000LL) {
+        sleep_ns(1000000);
+    }
+
+    double join_time = (double) (now_ns() - start) / 1e9;
+
+    shared->run_start = now_ns();
+    atomic_store(&shared->phase, LOAD_RUN);
+    sleep_ns((long long) (options->duration * 1e9));
+
+    double run_time = (double) (now_ns() - shared->run_start) / 1e9;
+
+    atomic_store(&shared->phase, LOAD_DRAIN);
+    sleep_ns((long long) (options->drain * 1e9));
+    atomic_store(&shared->phase, LOAD_STOP);
+
+    struct histogram latency, join;
+    size_t posted = 0, replies = 0, activity = 0, delivered = 0, bytes = 0, failed = 0;
+
+    histogram_init(&latency);
+    histogram_init(&join);
+
+    for (size_t i = 0; i < options->workers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+
+        histogram_merge(&latency, &workers[i].latency);
+        histogram_merge(&join, &workers[i].join);
+        posted += workers[i].posted;
+        replies += workers[i].replies;
+        activity += workers[i].activity;
+        delivered += workers[i].delivered;
+        bytes += workers[i].bytes;
+        failed += workers[i].failed;
+
+        free(workers[i].clients);
+    }
+
+    size_t connected = atomic_load(&shared->connected), joined = atomic_load(&shared->joined);
+    size_t followers = atomic_load(&shared->followers);
+    // new threads go to everyone, replies only to the followers
+    size_t expected = (posted - replies) * connected + replies * followers;
+
+    printf("load clients=%zu connected=%zu joined=%zu history=%zu fill=%.2fs join=%.2fs join_p50=%.1fms join_p99=%.1fms\n",
+           options->clients, connected, joined, options->history, fill_time, join_time,
+           (double) histogram_percentile(&join, 50) / 1e6, (double) histogram_percentile(&join, 99) / 1e6);
+    printf("load posted=%zu post_rate=%.0f/s delivered=%zu expected=%zu delivery_rate=%.0f/s failed=%zu\n",
+           posted, (double) posted / run_time, delivered, expected, (double) delivered / run_time, failed);
+    printf("load followers=%zu replies=%zu activity=%zu\n", followers, replies, activity);
+    printf("load latency p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+           (double) histogram_percentile(&latency, 50) / 1e3, (double) histogram_percentile(&latency, 99) / 1e3,
+           (double) histogram_percentile(&latency, 99.9) / 1e3, (double) latency.max / 1e3);
+
+    if (options->output_path) {
+        FILE * file = fopen(options->output_path, "w");
+
+        if (!file) {
+            printf("Cannot write %s\n", options->output_path);
+            return 2;
+        }
+
+        fprintf(file, "{\"clients\":%zu,\"workers\":%zu,\"rate\":%.3f,\"duration\":%.3f,\"history\":%zu,"
+                      "\"text_length\":%zu,\"reply_percent\":%u,\"max_depth\":%u,\"follow_percent\":%u,\"lazy\":%s,",
+                options->clients, options->workers, options->rate, run_time, options->history,
+                options->text_length, options->reply_percent, options->max_depth, options->follow_percent,
+                options->lazy ? "true" : "false");
+        fprintf(file, "\"connected\":%zu,\"joined\":%zu,\"fill_seconds\":%.3f,\"join_seconds\":%.3f,",
+                connected, joined, fill_time, join_time);
+        fprintf(file, "\"posted\":%zu,\"replies\":%zu,\"delivered\":%zu,\"expected\":%zu,\"failed\":%zu,"
+                      "\"followers\":%zu,\"activity\":%zu,\"bytes_received\":%zu,\"post_rate\":%.3f,\"delivery_rate\":%.3f,",
+                posted, replies, delivered, expected, failed, followers, activity, bytes,
+                (double) posted / run_time, (double) delivered / run_time);
+        histogram_print_json(file, "join_ms", &join, 1e6);
+        fprintf(file, ",");
+        histogram_print_json(file, "latency_us", &latency, 1e3);
+        fprintf(file, "}\n");
+
+        fclose(file);
+    }
+
+    free(workers);
+    free(shared);
+
+    return 0;
+}
@@ -9,18 +9,10 @@ int main(int argc, char * argv[]) {
 
     switch (argv[1][0]) {
         case 'c':
-            if (argc != 4) {
-                return 0;
-            }
-
-            return client_main(argv[2], argv[3]);
+            return client_main(argc - 1, argv + 1);
 
         case 's':
-            if (argc != 2) {
-                return 0;
-            }
-
-            return server_main();
+            return server_main(argc - 1, argv + 1);
     }
 
     return 0;
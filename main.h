@@ -1,4 +1,4 @@
 #pragma once
 
-int server_main();
-int client_main(const char * username, const char * host);
+int server_main(int argc, char * argv[]);
+int client_main(int argc, char * argv[]);
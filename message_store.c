@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "message_store.h"
+
+#define GROW(array, capacity) (array) = realloc((array), sizeof(*(array)) * (capacity))
+
+void message_store_init(struct message_store * store) {
+    memset(store, 0, sizeof(*store));
+
+    store->first_root = MESSAGE_STORE_NONE;
+    store->last_root = MESSAGE_STORE_NONE;
+    store->order_valid = true;
+
+    id_index_init(&store->index);
+    arena_init(&store->arena, ARENA_DEFAULT_CHUNK_SIZE);
+}
+
+static void message_store_grow(struct message_store * store) {
+    size_t capacity = store->capacity ? store->capacity * 2 : 1024;
+
+    GROW(store->ids, capacity);
+    GROW(store->parents, capacity);
+    GROW(store->roots, capacity);
+    GROW(store->latest_ids, capacity);
+    GROW(store->first_children, capacity);
+    GROW(store->last_children, capacity);
+    GROW(store->next_siblings, capacity);
+    GROW(store->previous_siblings, capacity);
+    GROW(store->depths, capacity);
+    GROW(store->subtree_sizes, capacity);
+    GROW(store->flags, capacity);
+    GROW(store->unread, capacity);
+    GROW(store->authors, capacity);
+    GROW(store->texts, capacity);
+    GROW(store->text_lengths, capacity);
+    GROW(store->order, capacity);
+    GROW(store->positions, capacity);
+
+    store->capacity = capacity;
+}
+
+char * message_store_alloc_text(struct message_store * store, size_t text_length) {
+    char * text = arena_alloc(&store->arena, text_length + 1);
+
+    text[text_length] = '\0';
+    return text;
+}
+
+int32_t message_store_find(const struct message_store * store, long long id) {
+    return (int32_t) id_index_get(&store->index, id) - 1;
+}
+
+int32_t message_store_add(struct message_store * store, long long id, long long parent_id,
+                          uint32_t author, char * text, size_t text_length) {
+    if (store->count == store->capacity) {
+        message_store_grow(store);
+    }
+
+    int32_t slot = (int32_t) store->count++;
+    int32_t parent = parent_id ? message_store_find(store, parent_id) : MESSAGE_STORE_NONE;
+
+    store->ids[slot] = id;
+    store->parents[slot] = parent;
+    store->roots[slot] = parent == MESSAGE_STORE_NONE ? slot : store->roots[parent];
+    store->latest_ids[slot] = id;
+
+    if (store->latest_ids[store->roots[slot]] < id) {
+        store->latest_ids[store->roots[slot]] = id;
+    }
+    store->first_children[slot] = MESSAGE_STORE_NONE;
+    store->last_children[slot] = MESSAGE_STORE_NONE;
+    store->next_siblings[slot] = MESSAGE_STORE_NONE;
+    store->previous_siblings[slot] = MESSAGE_STORE_NONE;
+    store->depths[slot] = parent == MESSAGE_STORE_NONE ? 0 : store->depths[parent] + 1;
+    store->subtree_sizes[slot] = 1;
+    store->flags[slot] = 0;
+    store->unread[slot] = 1;
+    store->authors[slot] = author;
+    store->texts[slot] = text;
+    store->text_lengths[slot] = (uint32_t) text_length;
+
+    int32_t * first = parent == MESSAGE_STORE_NONE ? &store->first_root : &store->first_children[parent];
+    int32_t * last = parent == MESSAGE_STORE_NONE ? &store->last_root : &store->last_children[parent];
+    bool appended = true;
+
+    if (*last == MESSAGE_STORE_NONE) {
+        *first = slot;
+        *last = slot;
+    } else if (store->ids[*last] < id) {
+        store->next_siblings[*last] = slot;
+        store->previous_siblings[slot] = *last;
+        *last = slot;
+    } else {
+        // an older message arriving late goes between its siblings
+        int32_t previous = MESSAGE_STORE_NONE, current = *first;
+
+        while (current != MESSAGE_STORE_NONE && store->ids[current] < id) {
+            previous = current;
+            current = store->next_siblings[current];
+        }
+
+        store->next_siblings[slot] = current;
+        store->previous_siblings[slot] = previous;
+        store->previous_siblings[current] = slot;
+
+        if (previous == MESSAGE_STORE_NONE) {
+            *first = slot;
+        } else {
+            store->next_siblings[previous] = slot;
+        }
+
+        appended = false;
+    }
+
+    if (store->order_valid) {
+        // the message ends the pre-order if it is the last child of a subtree that ends it
+        bool at_end = appended &&
+                      (parent == MESSAGE_STORE_NONE || store->positions[parent] + store->subtree_sizes[parent] == (uint32_t) slot);
+
+        if (at_end) {
+            store->order[slot] = slot;
+            store->positions[slot] = (uint32_t) slot;
+        } else {
+            store->order_valid = false;
+        }
+    }
+
+    for (int32_t ancestor = parent; ancestor != MESSAGE_STORE_NONE; ancestor = store->parents[ancestor]) {
+        ++store->subtree_sizes[ancestor];
+        ++store->unread[ancestor];
+    }
+
+    ++store->unread_total;
+
+    id_index_put(&store->index, id, (size_t) slot);
+
+    return slot;
+}
+
+const int32_t * message_store_order(struct message_store * store) {
+    if (store->order_valid) {
+        return store->order;
+    }
+
+    uint32_t position = 0;
+    int32_t slot = store->first_root;
+
+    while (slot != MESSAGE_STORE_NONE) {
+        store->order[position] = slot;
+        store->positions[slot] = position++;
+
+        if (store->first_children[slot] != MESSAGE_STORE_NONE) {
+            slot = store->first_children[slot];
+            continue;
+        }
+
+        while (slot != MESSAGE_STORE_NONE && store->next_siblings[slot] == MESSAGE_STORE_NONE) {
+            slot = store->parents[slot];
+        }
+
+        if (slot != MESSAGE_STORE_NONE) {
+            slot = store->next_siblings[slot];
+        }
+    }
+
+    store->order_valid = true;
+    return store->order;
+}
+
+void message_store_mark_read(struct message_store * store, int32_t slot) {
+    if (store->flags[slot] & MESSAGE_READ) {
+        return;
+    }
+
+    store->flags[slot] |= MESSAGE_READ;
+
+    for (int32_t ancestor = slot; ancestor != MESSAGE_STORE_NONE; ancestor = store->parents[ancestor]) {
+        --store->unread[ancestor];
+    }
+
+    --store->unread_total;
+}
+
+int32_t message_store_next_visible(const struct message_store * store, int32_t slot) {
+    if (!(store->flags[slot] & MESSAGE_COLLAPSED) && store->first_children[slot] != MESSAGE_STORE_NONE) {
+        return store->first_children[slot];
+    }
+
+    while (slot != MESSAGE_STORE_NONE && store->next_siblings[slot] == MESSAGE_STORE_NONE) {
+        slot = store->parents[slot];
+    }
+
+    return slot == MESSAGE_STORE_NONE ? MESSAGE_STORE_NONE : store->next_siblings[slot];
+}
+
+int32_t message_store_previous_visible(const struct message_store * store, int32_t slot) {
+    int32_t previous = store->previous_siblings[slot];
+
+    if (previous == MESSAGE_STORE_NONE) {
+        return store->parents[slot];
+    }
+
+    // the deepest last descendant of the previous sibling that is not hidden
+    while (!(store->flags[previous] & MESSAGE_COLLAPSED) && store->last_children[previous] != MESSAGE_STORE_NONE) {
+        previous = store->last_children[previous];
+    }
+
+    return previous;
+}
+
+void message_store_free(struct message_store * store) {
+    free(store->ids);
+    free(store->parents);
+    free(store->roots);
+    free(store->latest_ids);
+    free(store->first_children);
+    free(store->last_children);
+    free(store->next_siblings);
+    free(store->previous_siblings);
+    free(store->depths);
+    free(store->subtree_sizes);
+    free(store->flags);
+    free(store->unread);
+    free(store->authors);
+    free(store->texts);
+    free(store->text_lengths);
+    free(store->order);
+    free(store->positions);
+
+    id_index_free(&store->index);
+    arena_free(&store->arena);
+
+    message_store_init(store);
+}
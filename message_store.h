@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "id_index.h"
+
+#define MESSAGE_STORE_NONE (-1)
+// slots are int32_t and ids are given from 1 on, so no store holds a greater id
+#define MESSAGE_STORE_MAX_ID INT32_MAX
+
+// per message flags, only the client uses them
+#define MESSAGE_READ 1
+#define MESSAGE_COLLAPSED 2
+
+/*
+ * Message threads as structure-of-arrays indexed by slot, slots are given in arrival order.
+ * Links between messages are slots, not pointers; siblings are kept in ascending id order.
+ * The pre-order of all messages is kept in a separate array which is extended in place
+ * when a message lands at its end (a new thread or a reply to the latest one) and rebuilt
+ * lazily otherwise, so traversals are sequential scans that skip subtrees by their sizes.
+ * Texts are allocated from the arena, authors are ids of an author_table kept by the owner of the store.
+ */
+struct message_store {
+    size_t count;
+    size_t capacity;
+
+    long long * ids;
+    int32_t * parents;
+    int32_t * roots;          // the root of the thread of every message
+    long long * latest_ids;   // the newest message of a thread, kept at its root
+    int32_t * first_children;
+    int32_t * last_children;
+    int32_t * next_siblings;
+    int32_t * previous_siblings;
+    uint32_t * depths;
+    uint32_t * subtree_sizes; // the message itself included
+    uint8_t * flags;
+    uint32_t * unread;        // unread messages of the subtree, the message itself included
+    uint32_t * authors;
+    char ** texts;            // terminated
+    uint32_t * text_lengths;
+
+    int32_t first_root;
+    int32_t last_root;
+    size_t unread_total;
+
+    int32_t * order;          // slots in pre-order
+    uint32_t * positions;     // position of every slot in the order
+    bool order_valid;
+
+    struct id_index index;
+    struct arena arena;
+};
+
+void message_store_init(struct message_store * store);
+// room for the text of a message that is about to be added, already terminated
+char * message_store_alloc_text(struct message_store * store, size_t text_length);
+// a message with an unknown parent becomes a root, returns the slot
+int32_t message_store_add(struct message_store * store, long long id, long long parent_id,
+                          uint32_t author, char * text, size_t text_length);
+int32_t message_store_find(const struct message_store * store, long long id);
+// slots of all messages in pre-order, count entries
+const int32_t * message_store_order(struct message_store * store);
+// clears the unread state of a message and of the counters of its ancestors
+void message_store_mark_read(struct message_store * store, int32_t slot);
+// neighbours of a slot among the messages outside of collapsed subtrees, MESSAGE_STORE_NONE at the ends
+int32_t message_store_next_visible(const struct message_store * store, int32_t slot);
+int32_t message_store_previous_visible(const struct message_store * store, int32_t slot);
+void message_store_free(struct message_store * store);
+
+static inline const char * message_store_text(const struct message_store * store, int32_t slot) {
+    return store->texts[slot];
+}
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static const char * metrics_counter_names[METRICS_COUNTERS] = {
+    [METRICS_MESSAGES_IN] = "messages_in",
+    [METRICS_MESSAGES_OUT] = "messages_out",
+    [METRICS_BYTES_IN] = "bytes_in",
+    [METRICS_BYTES_OUT] = "bytes_out",
+    [METRICS_CONNECTIONS_OPENED] = "connections_opened",
+    [METRICS_CONNECTIONS_CLOSED] = "connections_closed",
+    [METRICS_DROPPED_FRAMES] = "dropped_frames",
+    [METRICS_LOG_SUPPRESSED] = "log_suppressed",
+    [METRICS_URING_ENTERS] = "uring_enters",
+    [METRICS_URING_SENDS] = "uring_sends",
+};
+
+static const char * metrics_histogram_names[METRICS_HISTOGRAMS] = {
+    [METRICS_INGEST_TO_BROADCAST] = "ingest_to_broadcast_us",
+    [METRICS_FANOUT] = "fanout_us",
+    [METRICS_BATCH_SIZE] = "batch_size",
+};
+
+static const double metrics_histogram_units[METRICS_HISTOGRAMS] = {
+    [METRICS_INGEST_TO_BROADCAST] = 1e3,
+    [METRICS_FANOUT] = 1e3,
+    [METRICS_BATCH_SIZE] = 1,
+};
+
+// the thread is gone, the next new thread continues its counts
+static void metrics_release_shard(void * param) {
+    struct metrics_shard * shard = param;
+
+    atomic_store_explicit(&shard->in_use, false, memory_order_release);
+}
+
+void metrics_init(struct metrics * metrics) {
+    atomic_init(&metrics->shards, NULL);
+    pthread_key_create(&metrics->key, metrics_release_shard);
+}
+
+static struct metrics_shard * metrics_shard(struct metrics * metrics) {
+    struct metrics_shard * shard = pthread_getspecific(metrics->key);
+
+    if (shard) {
+        return shard;
+    }
+
+    for (shard = atomic_load(&metrics->shards); shard; shard = shard->next) {
+        bool expected = false;
+
+        if (atomic_compare_exchange_strong_explicit(&shard->in_use, &expected, true,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            pthread_setspecific(metrics->key, shard);
+            return shard;
+        }
+    }
+
+    shard = malloc(sizeof(struct metrics_shard));
+    memset(shard->counters, 0, sizeof(shard->counters));
+    atomic_init(&shard->in_use, true);
+
+    for (int i = 0; i < METRICS_HISTOGRAMS; ++i) {
+        histogram_init(&shard->histograms[i]);
+    }
+
+    shard->next = atomic_load(&metrics->shards);
+
+    while (!atomic_compare_exchange_weak(&metrics->shards, &shard->next, shard));
+
+    pthread_setspecific(metrics->key, shard);
+    return shard;
+}
+
+void metrics_add(struct metrics * metrics, enum metrics_counter counter, int64_t value) {
+    struct metrics_shard * shard = metrics_shard(metrics);
+
+    STORE(shard->counters[counter], LOAD(shard->counters[counter]) + value);
+}
+
+void metrics_record(struct metrics * metrics, enum metrics_histogram histogram, uint64_t value) {
+    histogram_record(&metrics_shard(metrics)->histograms[histogram], value);
+}
+
+void metrics_collect(struct metrics * metrics, int64_t counters[METRICS_COUNTERS], struct histogram histograms[METRICS_HISTOGRAMS]) {
+    memset(counters, 0, sizeof(int64_t) * METRICS_COUNTERS);
+
+    for (int i = 0; i < METRICS_HISTOGRAMS; ++i) {
+        histogram_init(&histograms[i]);
+    }
+
+    for (struct metrics_shard * shard = atomic_load(&metrics->shards); shard; shard = shard->next) {
+        for (int i = 0; i < METRICS_COUNTERS; ++i) {
+            counters[i] += LOAD(shard->counters[i]);
+        }
+
+        for (int i = 0; i < METRICS_HISTOGRAMS; ++i) {
+            histogram_merge(&histograms[i], &shard->histograms[i]);
+        }
+    }
+}
+
+const char * metrics_counter_name(enum metrics_counter counter) {
+    return metrics_counter_names[counter];
+}
+
+const char * metrics_histogram_name(enum metrics_histogram histogram) {
+    return metrics_histogram_names[histogram];
+}
+
+double metrics_histogram_unit(enum metrics_histogram histogram) {
+    return metrics_histogram_units[histogram];
+}
+
+void metrics_free(struct metrics * metrics) {
+    struct metrics_shard * shard = atomic_load(&metrics->shards);
+
+    while (shard) {
+        struct metrics_shard * next = shard->next;
+
+        // pairs with the release of a finished thread, its last counts happen before the free
+        atomic_load_explicit(&shard->in_use, memory_order_acquire);
+        free(shard);
+        shard = next;
+    }
+
+    pthread_key_delete(metrics->key);
+    atomic_init(&metrics->shards, NULL);
+}
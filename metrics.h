@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "histogram.h"
+
+enum metrics_counter {
+    METRICS_MESSAGES_IN,
+    METRICS_MESSAGES_OUT,   // deliveries queued for clients
+    METRICS_BYTES_IN,
+    METRICS_BYTES_OUT,
+    METRICS_CONNECTIONS_OPENED,
+    METRICS_CONNECTIONS_CLOSED,
+    METRICS_DROPPED_FRAMES,
+    METRICS_LOG_SUPPRESSED,
+    METRICS_URING_ENTERS,   // io_uring_enter calls of the io_uring backend
+    METRICS_URING_SENDS,    // sends it submitted with them
+    METRICS_COUNTERS,
+};
+
+enum metrics_histogram {
+    METRICS_INGEST_TO_BROADCAST, // nanoseconds from decoding a post to having it queued for every client
+    METRICS_FANOUT,              // nanoseconds of the loop over the clients
+    METRICS_BATCH_SIZE,          // posts the sequencer takes from the ingest ring at once
+    METRICS_HISTOGRAMS,
+};
+
+// counters of one thread, only the thread that holds it writes to it
+struct metrics_shard {
+    struct metrics_shard * next;
+    atomic_bool in_use;
+
+    int64_t counters[METRICS_COUNTERS];
+    struct histogram histograms[METRICS_HISTOGRAMS];
+};
+
+/*
+ * Server telemetry without locks on the recording path. Every thread records into a shard of its own,
+ * which is found through a thread-specific key, so counters are plain relaxed stores.
+ * Readers sum the shards. A shard of a finished thread keeps its counts and is taken over by the
+ * next new thread, so the threads mode does not grow a shard per client.
+ */
+struct metrics {
+    _Atomic(struct metrics_shard *) shards;
+    pthread_key_t key;
+};
+
+void metrics_init(struct metrics * metrics);
+void metrics_add(struct metrics * metrics, enum metrics_counter counter, int64_t value);
+void metrics_record(struct metrics * metrics, enum metrics_histogram histogram, uint64_t value);
+// sums of all shards, may run concurrently with recording
+void metrics_collect(struct metrics * metrics, int64_t counters[METRICS_COUNTERS], struct histogram histograms[METRICS_HISTOGRAMS]);
+const char * metrics_counter_name(enum metrics_counter counter);
+const char * metrics_histogram_name(enum metrics_histogram histogram);
+// the recorded value per printed one
+double metrics_histogram_unit(enum metrics_histogram histogram);
+// no thread may record any more
+void metrics_free(struct metrics * metrics);
@@ -0,0 +1,465 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "protocol.h"
+
+#define PROTOCOL_MAX_VARINT_LENGTH 10
+
+static size_t protocol_varint_length(uint64_t value) {
+    size_t length = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        ++length;
+    }
+
+    return length;
+}
+
+static size_t protocol_put_varint(char * buffer, size_t offset, uint64_t value) {
+    while (value >= 0x80) {
+        buffer[offset++] = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+
+    buffer[offset++] = (char) value;
+    return offset;
+}
+
+static size_t protocol_put(char * buffer, size_t offset, const void * data, size_t length) {
+    memcpy(buffer + offset, data, length);
+    return offset + length;
+}
+
+// returns false if the varint runs over the end or is too long
+static bool protocol_get_varint(const char * data, size_t length, size_t * offset, uint64_t * value) {
+    uint64_t result = 0;
+
+    for (size_t i = 0; i < PROTOCOL_MAX_VARINT_LENGTH && *offset + i < length; ++i) {
+        uint8_t byte = (uint8_t) data[*offset + i];
+        result |= (uint64_t) (byte & 0x7F) << (7 * i);
+
+        if (!(byte & 0x80)) {
+            *offset += i + 1;
+            *value = result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static size_t protocol_frame_header(char * buffer, unsigned type, size_t body_length) {
+    size_t offset = protocol_put_varint(buffer, 0, 1 + body_length);
+
+    buffer[offset++] = (char) type;
+    return offset;
+}
+
+static size_t protocol_frame_size(size_t body_length) {
+    return protocol_varint_length(1 + body_length) + 1 + body_length;
+}
+
+static size_t protocol_string_length(size_t length) {
+    return protocol_varint_length(length) + length;
+}
+
+static size_t protocol_put_string(char * buffer, size_t offset, const char * string, size_t length) {
+    offset = protocol_put_varint(buffer, offset, length);
+
+    return protocol_put(buffer, offset, string, length);
+}
+
+size_t protocol_encode_hello(char * buffer, long long last_id, const char * username, size_t username_length,
+                             unsigned flags, uint64_t history_id) {
+    size_t body_length = PROTOCOL_MAGIC_LENGTH + protocol_varint_length(PROTOCOL_VERSION) +
+                         protocol_varint_length((uint64_t) last_id) + protocol_string_length(username_length) +
+                         protocol_varint_length(flags) + protocol_varint_length(history_id);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_HELLO, body_length);
+
+    offset = protocol_put(buffer, offset, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH);
+    offset = protocol_put_varint(buffer, offset, PROTOCOL_VERSION);
+    offset = protocol_put_varint(buffer, offset, (uint64_t) last_id);
+    offset = protocol_put_string(buffer, offset, username, username_length);
+    offset = protocol_put_varint(buffer, offset, flags);
+
+    return protocol_put_varint(buffer, offset, history_id);
+}
+
+size_t protocol_encode_welcome(char * buffer, const struct protocol_welcome * welcome) {
+    size_t body_length = protocol_varint_length(welcome->version) + protocol_varint_length(welcome->history_id) +
+                         protocol_varint_length((uint64_t) welcome->last_id);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_WELCOME, body_length);
+
+    offset = protocol_put_varint(buffer, offset, welcome->version);
+    offset = protocol_put_varint(buffer, offset, welcome->history_id);
+
+    return protocol_put_varint(buffer, offset, (uint64_t) welcome->last_id);
+}
+
+size_t protocol_author_length(uint32_t id, size_t name_length) {
+    return protocol_frame_size(protocol_varint_length(id) + protocol_string_length(name_length));
+}
+
+size_t protocol_encode_author(char * buffer, uint32_t id, const char * name, size_t name_length) {
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_AUTHOR, protocol_varint_length(id) + protocol_string_length(name_length));
+
+    offset = protocol_put_varint(buffer, offset, id);
+
+    return protocol_put_string(buffer, offset, name, name_length);
+}
+
+size_t protocol_post_length(long long reply_id, size_t message_length) {
+    return protocol_frame_size(protocol_varint_length((uint64_t) reply_id) + protocol_string_length(message_length));
+}
+
+size_t protocol_encode_post(char * buffer, long long reply_id, const char * message, size_t message_length) {
+    size_t body_length = protocol_varint_length((uint64_t) reply_id) + protocol_string_length(message_length);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_POST, body_length);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) reply_id);
+
+    return protocol_put_string(buffer, offset, message, message_length);
+}
+
+static size_t protocol_message_body_length(long long id, long long reply_id, uint32_t author, size_t text_length) {
+    return protocol_varint_length((uint64_t) id) + protocol_varint_length((uint64_t) reply_id) +
+           protocol_varint_length(author) + protocol_string_length(text_length);
+}
+
+size_t protocol_message_length(long long id, long long reply_id, uint32_t author, size_t text_length) {
+    return protocol_frame_size(protocol_message_body_length(id, reply_id, author, text_length));
+}
+
+size_t protocol_encode_message(char * buffer, long long id, long long reply_id, uint32_t author,
+                               const char * text, size_t text_length) {
+    size_t body_length = protocol_message_body_length(id, reply_id, author, text_length);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_MESSAGE, body_length);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) id);
+    offset = protocol_put_varint(buffer, offset, (uint64_t) reply_id);
+    offset = protocol_put_varint(buffer, offset, author);
+
+    return protocol_put_string(buffer, offset, text, text_length);
+}
+
+size_t protocol_encode_subscribe(char * buffer, long long root_id, bool subscribed) {
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_SUBSCRIBE, protocol_varint_length((uint64_t) root_id) + 1);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) root_id);
+
+    return protocol_put_varint(buffer, offset, subscribed);
+}
+
+size_t protocol_activity_length(long long root_id, uint32_t replies) {
+    return protocol_frame_size(protocol_varint_length((uint64_t) root_id) + protocol_varint_length(replies));
+}
+
+size_t protocol_encode_activity(char * buffer, long long root_id, uint32_t replies) {
+    size_t body_length = protocol_varint_length((uint64_t) root_id) + protocol_varint_length(replies);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_ACTIVITY, body_length);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) root_id);
+
+    return protocol_put_varint(buffer, offset, replies);
+}
+
+size_t protocol_thread_length(const struct protocol_thread * thread) {
+    return protocol_frame_size(protocol_varint_length((uint64_t) thread->root_id) + protocol_varint_length(thread->replies) +
+                               protocol_varint_length((uint64_t) thread->latest_id));
+}
+
+size_t protocol_encode_thread(char * buffer, const struct protocol_thread * thread) {
+    size_t body_length = protocol_varint_length((uint64_t) thread->root_id) + protocol_varint_length(thread->replies) +
+                         protocol_varint_length((uint64_t) thread->latest_id);
+    size_t offset = protocol_frame_header(buffer, PROTOCOL_THREAD, body_length);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) thread->root_id);
+    offset = protocol_put_varint(buffer, offset, thread->replies);
+
+    return protocol_put_varint(buffer, offset, (uint64_t) thread->latest_id);
+}
+
+// fetch and more are two ids
+static size_t protocol_encode_ids(char * buffer, unsigned type, long long first, long long second) {
+    size_t body_length = protocol_varint_length((uint64_t) first) + protocol_varint_length((uint64_t) second);
+    size_t offset = protocol_frame_header(buffer, type, body_length);
+
+    offset = protocol_put_varint(buffer, offset, (uint64_t) first);
+
+    return protocol_put_varint(buffer, offset, (uint64_t) second);
+}
+
+size_t protocol_encode_fetch(char * buffer, long long root_id, long long after_id) {
+    return protocol_encode_ids(buffer, PROTOCOL_FETCH, root_id, after_id);
+}
+
+size_t protocol_encode_more(char * buffer, long long root_id, long long last_id) {
+    return protocol_encode_ids(buffer, PROTOCOL_MORE, root_id, last_id);
+}
+
+size_t protocol_frame_length(const char * data) {
+    size_t offset = 0;
+    uint64_t length = 0;
+
+    protocol_get_varint(data, PROTOCOL_MAX_VARINT_LENGTH, &offset, &length);
+
+    return offset + (size_t) length;
+}
+
+static bool protocol_get_string(const struct protocol_frame * frame, size_t * offset, size_t limit,
+                                const char ** string, size_t * length) {
+    uint64_t value;
+
+    if (!protocol_get_varint(frame->body, frame->length, offset, &value) ||
+        value > limit || value > frame->length - *offset) {
+        return false;
+    }
+
+    *string = frame->body + *offset;
+    *length = (size_t) value;
+    *offset += (size_t) value;
+
+    return true;
+}
+
+static bool protocol_get_uint32(const struct protocol_frame * frame, size_t * offset, uint32_t * author) {
+    uint64_t value;
+
+    if (!protocol_get_varint(frame->body, frame->length, offset, &value) || value > UINT32_MAX) {
+        return false;
+    }
+
+    *author = (uint32_t) value;
+    return true;
+}
+
+bool protocol_decode_hello(const struct protocol_frame * frame, struct protocol_hello * hello) {
+    size_t offset = PROTOCOL_MAGIC_LENGTH;
+    uint64_t highest, last;
+
+    if (frame->type != PROTOCOL_HELLO || frame->length < PROTOCOL_MAGIC_LENGTH ||
+        memcmp(frame->body, PROTOCOL_MAGIC, PROTOCOL_MAGIC_LENGTH) != 0 ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &highest) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &last)) {
+        return false;
+    }
+
+    hello->version = highest > PROTOCOL_VERSION ? PROTOCOL_VERSION : (unsigned) highest;
+    hello->last_id = (long long) last;
+
+    // older versions end here, the caller rejects them by the version
+    hello->username = NULL;
+    hello->username_length = 0;
+    hello->flags = 0;
+    hello->history_id = 0;
+
+    if (highest < PROTOCOL_VERSION) {
+        return true;
+    }
+
+    uint64_t flags;
+
+    if (!protocol_get_string(frame, &offset, PROTOCOL_MAX_AUTHOR_LENGTH, &hello->username, &hello->username_length) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &flags) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &hello->history_id)) {
+        return false;
+    }
+
+    hello->flags = (unsigned) flags;
+    return true;
+}
+
+bool protocol_decode_welcome(const struct protocol_frame * frame, struct protocol_welcome * welcome) {
+    size_t offset = 0;
+    uint64_t version, last_id;
+
+    if (frame->type != PROTOCOL_WELCOME ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &version) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &welcome->history_id) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &last_id)) {
+        return false;
+    }
+
+    welcome->version = (unsigned) version;
+    welcome->last_id = (long long) last_id;
+    return true;
+}
+
+bool protocol_decode_author(const struct protocol_frame * frame, uint32_t * id, const char ** name, size_t * name_length) {
+    size_t offset = 0;
+
+    return frame->type == PROTOCOL_AUTHOR &&
+           protocol_get_uint32(frame, &offset, id) &&
+           protocol_get_string(frame, &offset, PROTOCOL_MAX_AUTHOR_LENGTH, name, name_length);
+}
+
+bool protocol_decode_post(const struct protocol_frame * frame, struct protocol_message * post) {
+    size_t offset = 0;
+    uint64_t reply_id;
+
+    if (frame->type != PROTOCOL_POST ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &reply_id) ||
+        !protocol_get_string(frame, &offset, PROTOCOL_MAX_FIELD_LENGTH, &post->text, &post->text_length)) {
+        return false;
+    }
+
+    post->id = 0;
+    post->reply_id = (long long) reply_id;
+    post->author = 0;
+
+    return true;
+}
+
+bool protocol_decode_message(const struct protocol_frame * frame, struct protocol_message * message) {
+    size_t offset = 0;
+    uint64_t id, reply_id;
+
+    if (frame->type != PROTOCOL_MESSAGE ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &id) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &reply_id) ||
+        !protocol_get_uint32(frame, &offset, &message->author) ||
+        !protocol_get_string(frame, &offset, PROTOCOL_MAX_FIELD_LENGTH, &message->text, &message->text_length)) {
+        return false;
+    }
+
+    message->id = (long long) id;
+    message->reply_id = (long long) reply_id;
+
+    return true;
+}
+
+bool protocol_decode_subscribe(const struct protocol_frame * frame, long long * root_id, bool * subscribed) {
+    size_t offset = 0;
+    uint64_t root, value;
+
+    if (frame->type != PROTOCOL_SUBSCRIBE ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &root) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &value) || value > 1) {
+        return false;
+    }
+
+    *root_id = (long long) root;
+    *subscribed = value == 1;
+
+    return true;
+}
+
+bool protocol_decode_activity(const struct protocol_frame * frame, long long * root_id, uint32_t * replies) {
+    size_t offset = 0;
+    uint64_t root;
+
+    if (frame->type != PROTOCOL_ACTIVITY ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &root) ||
+        !protocol_get_uint32(frame, &offset, replies)) {
+        return false;
+    }
+
+    *root_id = (long long) root;
+    return true;
+}
+
+bool protocol_decode_thread(const struct protocol_frame * frame, struct protocol_thread * thread) {
+    size_t offset = 0;
+    uint64_t root, latest;
+
+    if (frame->type != PROTOCOL_THREAD ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &root) ||
+        !protocol_get_uint32(frame, &offset, &thread->replies) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &latest)) {
+        return false;
+    }
+
+    thread->root_id = (long long) root;
+    thread->latest_id = (long long) latest;
+
+    return true;
+}
+
+static bool protocol_decode_ids(const struct protocol_frame * frame, unsigned type, long long * first, long long * second) {
+    size_t offset = 0;
+    uint64_t values[2];
+
+    if (frame->type != type ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &values[0]) ||
+        !protocol_get_varint(frame->body, frame->length, &offset, &values[1])) {
+        return false;
+    }
+
+    *first = (long long) values[0];
+    *second = (long long) values[1];
+
+    return true;
+}
+
+bool protocol_decode_fetch(const struct protocol_frame * frame, long long * root_id, long long * after_id) {
+    return protocol_decode_ids(frame, PROTOCOL_FETCH, root_id, after_id);
+}
+
+bool protocol_decode_more(const struct protocol_frame * frame, long long * root_id, long long * last_id) {
+    return protocol_decode_ids(frame, PROTOCOL_MORE, root_id, last_id);
+}
+
+void protocol_reader_init(struct protocol_reader * reader, size_t capacity) {
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->length = 0;
+    reader->buffer = malloc(capacity);
+}
+
+char * protocol_reader_space(struct protocol_reader * reader, size_t * room) {
+    if (reader->start > 0) {
+        reader->length -= reader->start;
+        memmove(reader->buffer, reader->buffer + reader->start, reader->length);
+        reader->start = 0;
+    }
+
+    // a frame larger than the buffer grows it, PROTOCOL_MAX_FRAME_LENGTH bounds the growth
+    if (reader->length == reader->capacity) {
+        reader->capacity *= 2;
+        reader->buffer = realloc(reader->buffer, reader->capacity);
+    }
+
+    *room = reader->capacity - reader->length;
+    return reader->buffer + reader->length;
+}
+
+void protocol_reader_commit(struct protocol_reader * reader, size_t length) {
+    reader->length += length;
+}
+
+enum protocol_status protocol_reader_next(struct protocol_reader * reader, struct protocol_frame * frame) {
+    const char * data = reader->buffer + reader->start;
+    size_t available = reader->length - reader->start, offset = 0;
+    uint64_t length;
+
+    if (!protocol_get_varint(data, available, &offset, &length)) {
+        return available < PROTOCOL_MAX_VARINT_LENGTH ? PROTOCOL_INCOMPLETE : PROTOCOL_MALFORMED;
+    }
+
+    if (length == 0 || length > PROTOCOL_MAX_FRAME_LENGTH) {
+        return PROTOCOL_MALFORMED;
+    }
+
+    if (available - offset < length) {
+        return PROTOCOL_INCOMPLETE;
+    }
+
+    frame->type = (uint8_t) data[offset];
+    frame->body = data + offset + 1;
+    frame->length = (size_t) length - 1;
+
+    reader->start += offset + (size_t) length;
+
+    return PROTOCOL_FRAME;
+}
+
+void protocol_reader_reset(struct protocol_reader * reader) {
+    reader->start = 0;
+    reader->length = 0;
+}
+
+void protocol_reader_free(struct protocol_reader * reader) {
+    free(reader->buffer);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Version 6. Every frame is <length><type><body>, where length counts the type byte and the body.
+ * All numbers are unsigned LEB128 varints, so the encoding does not depend on the byte order of the host.
+ *
+ * hello (client -> server):   <magic "S265"><highest version the client speaks><last message id the client has or 0>
+ *                             <username length><username><flags><history id the last id belongs to or 0>,
+ *                             the first frame after connecting
+ * welcome (server -> client): <version both sides use><history id><newest id of the history>, the answer to hello,
+ *                             the author table and history follow it
+ * author (server -> client):  <author id><name length><name>, sent before the first message that refers to the id
+ * post (client -> server):    <reply_id or 0><text length><text>, the author is the username of the hello
+ * message (server -> client): <id><reply_id or 0><author id><text length><text>
+ * subscribe (client -> server): <root id, 0 - every thread><1 - subscribe, 0 - unsubscribe>
+ * activity (server -> client):  <root id><new replies>, to every client that does not follow all threads
+ * thread (server -> client):    <root id><replies><latest id in the thread>, follows a root in a lazy history
+ * fetch (client -> server):     <root id><id the client has the thread up to or 0>
+ * more (server -> client):      <root id><last id sent>, the fetched page is not the last one
+ *
+ * New threads go to every client, replies only to the subscribers of their thread. A new subscriber
+ * first gets the whole thread, so a thread the client has subscribed to is always complete.
+ *
+ * A client joining with PROTOCOL_HELLO_LAZY gets only the roots of the history, each one followed by
+ * a thread summary. Fetch returns the replies of a thread after the given id in id order, so parents
+ * always come before their replies, at most PROTOCOL_PAGE_MESSAGES at a time; the last page also
+ * subscribes the client to the thread. Until then the client asks for the next page after a more.
+ *
+ * A history id names the history of a server, a server that starts over without its log has a new one.
+ * The server replays everything to a client that has messages of another history or newer than its own
+ * newest one, the client drops what it has then by the same rule.
+ *
+ * Author ids are given by the server and are only valid within one connection.
+ * Every frame is encoded into one contiguous buffer so it can be sent with a single syscall.
+ */
+
+#define PROTOCOL_VERSION 6
+#define PROTOCOL_MAGIC "S265"
+#define PROTOCOL_MAGIC_LENGTH 4
+
+// upper bound for text lengths, frames over PROTOCOL_MAX_FRAME_LENGTH are malformed
+#define PROTOCOL_MAX_FIELD_LENGTH (1 << 20)
+#define PROTOCOL_MAX_FRAME_LENGTH (PROTOCOL_MAX_FIELD_LENGTH + 64)
+#define PROTOCOL_MAX_AUTHOR_LENGTH 255
+// upper bound for hello, welcome and author frames
+#define PROTOCOL_HELLO_LENGTH (PROTOCOL_MAX_AUTHOR_LENGTH + 48)
+// upper bound for subscribe, activity, thread, fetch and more frames
+#define PROTOCOL_SUBSCRIBE_LENGTH 32
+#define PROTOCOL_PAGE_MESSAGES 256
+
+// hello flags
+#define PROTOCOL_HELLO_LAZY 1
+
+enum protocol_frame_type {
+    PROTOCOL_HELLO = 1,
+    PROTOCOL_WELCOME = 2,
+    PROTOCOL_POST = 3,
+    PROTOCOL_MESSAGE = 4,
+    PROTOCOL_AUTHOR = 5,
+    PROTOCOL_SUBSCRIBE = 6,
+    PROTOCOL_ACTIVITY = 7,
+    PROTOCOL_THREAD = 8,
+    PROTOCOL_FETCH = 9,
+    PROTOCOL_MORE = 10,
+};
+
+enum protocol_status {
+    PROTOCOL_FRAME,
+    PROTOCOL_INCOMPLETE,
+    PROTOCOL_MALFORMED,
+};
+
+// a received frame, the body points into the reader buffer until the next read
+struct protocol_frame {
+    unsigned type;
+    const char * body;
+    size_t length;
+};
+
+// a decoded hello, the username points into the frame body and is not terminated
+struct protocol_hello {
+    unsigned version;
+    long long last_id;
+    const char * username;
+    size_t username_length;
+    unsigned flags;
+    uint64_t history_id;
+};
+
+struct protocol_welcome {
+    unsigned version;
+    uint64_t history_id;
+    long long last_id;
+};
+
+// the summary of a thread in a lazy history
+struct protocol_thread {
+    long long root_id;
+    uint32_t replies;
+    long long latest_id;
+};
+
+// a decoded post or message, the text points into the frame body and is not terminated
+struct protocol_message {
+    long long id;
+    long long reply_id;
+    uint32_t author;
+    const char * text;
+    size_t text_length;
+};
+
+// username_length must not exceed PROTOCOL_MAX_AUTHOR_LENGTH
+size_t protocol_encode_hello(char * buffer, long long last_id, const char * username, size_t username_length,
+                             unsigned flags, uint64_t history_id);
+size_t protocol_encode_welcome(char * buffer, const struct protocol_welcome * welcome);
+
+size_t protocol_author_length(uint32_t id, size_t name_length);
+size_t protocol_encode_author(char * buffer, uint32_t id, const char * name, size_t name_length);
+
+size_t protocol_post_length(long long reply_id, size_t message_length);
+size_t protocol_encode_post(char * buffer, long long reply_id, const char * message, size_t message_length);
+
+size_t protocol_message_length(long long id, long long reply_id, uint32_t author, size_t text_length);
+size_t protocol_encode_message(char * buffer, long long id, long long reply_id, uint32_t author,
+                               const char * text, size_t text_length);
+size_t protocol_encode_subscribe(char * buffer, long long root_id, bool subscribed);
+size_t protocol_activity_length(long long root_id, uint32_t replies);
+size_t protocol_encode_activity(char * buffer, long long root_id, uint32_t replies);
+size_t protocol_thread_length(const struct protocol_thread * thread);
+size_t protocol_encode_thread(char * buffer, const struct protocol_thread * thread);
+size_t protocol_encode_fetch(char * buffer, long long root_id, long long after_id);
+size_t protocol_encode_more(char * buffer, long long root_id, long long last_id);
+// size of a complete frame that starts at data
+size_t protocol_frame_length(const char * data);
+
+bool protocol_decode_hello(const struct protocol_frame * frame, struct protocol_hello * hello);
+bool protocol_decode_welcome(const struct protocol_frame * frame, struct protocol_welcome * welcome);
+bool protocol_decode_author(const struct protocol_frame * frame, uint32_t * id, const char ** name, size_t * name_length);
+bool protocol_decode_post(const struct protocol_frame * frame, struct protocol_message * post);
+bool protocol_decode_message(const struct protocol_frame * frame, struct protocol_message * message);
+bool protocol_decode_subscribe(const struct protocol_frame * frame, long long * root_id, bool * subscribed);
+bool protocol_decode_activity(const struct protocol_frame * frame, long long * root_id, uint32_t * replies);
+bool protocol_decode_thread(const struct protocol_frame * frame, struct protocol_thread * thread);
+bool protocol_decode_fetch(const struct protocol_frame * frame, long long * root_id, long long * after_id);
+bool protocol_decode_more(const struct protocol_frame * frame, long long * root_id, long long * last_id);
+
+/*
+ * Receive buffer that is filled with as much as one read returns and parsed frame by frame,
+ * frames may be split between reads or several of them may come with one read.
+ */
+struct protocol_reader {
+    size_t capacity;
+    size_t start;  // the first byte that is not parsed yet
+    size_t length;
+    char * buffer;
+};
+
+void protocol_reader_init(struct protocol_reader * reader, size_t capacity);
+// free room at the end of the buffer, the bytes of frames parsed already are dropped first
+char * protocol_reader_space(struct protocol_reader * reader, size_t * room);
+void protocol_reader_commit(struct protocol_reader * reader, size_t length);
+enum protocol_status protocol_reader_next(struct protocol_reader * reader, struct protocol_frame * frame);
+void protocol_reader_reset(struct protocol_reader * reader);
+void protocol_reader_free(struct protocol_reader * reader);
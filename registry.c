@@ -0,0 +1,223 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "registry.h"
+
+static struct registry_snapshot * registry_snapshot_new(size_t count) {
+    struct registry_snapshot * snapshot = malloc(sizeof(struct registry_snapshot) + sizeof(void *) * count);
+
+    snapshot->count = count;
+    return snapshot;
+}
+
+// the thread is gone, its slot goes to the next new reader
+static void registry_release_reader(void * param) {
+    struct registry_reader * reader = param;
+
+    atomic_store_explicit(&reader->in_use, false, memory_order_release);
+}
+
+void registry_init(struct registry * registry, registry_free_callback free_item) {
+    atomic_init(&registry->current, registry_snapshot_new(0));
+    atomic_init(&registry->epoch, 1);
+    atomic_init(&registry->readers, NULL);
+    pthread_key_create(&registry->key, registry_release_reader);
+
+    pthread_mutex_init(&registry->lock, NULL);
+    registry->retired = NULL;
+    atomic_init(&registry->retired_count, 0);
+
+    registry->free_item = free_item;
+}
+
+static struct registry_reader * registry_reader(struct registry * registry) {
+    struct registry_reader * reader = pthread_getspecific(registry->key);
+
+    if (reader) {
+        return reader;
+    }
+
+    for (reader = atomic_load(&registry->readers); reader; reader = reader->next) {
+        bool expected = false;
+
+        if (atomic_compare_exchange_strong_explicit(&reader->in_use, &expected, true,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            pthread_setspecific(registry->key, reader);
+            return reader;
+        }
+    }
+
+    reader = malloc(sizeof(struct registry_reader));
+    atomic_init(&reader->in_use, true);
+    atomic_init(&reader->epoch, 0);
+    reader->depth = 0;
+    reader->next = atomic_load(&registry->readers);
+
+    while (!atomic_compare_exchange_weak(&registry->readers, &reader->next, reader));
+
+    pthread_setspecific(registry->key, reader);
+    return reader;
+}
+
+const struct registry_snapshot * registry_read_begin(struct registry * registry) {
+    struct registry_reader * reader = registry_reader(registry);
+
+    // the epoch is published before the snapshot is loaded, both sequentially consistent
+    if (reader->depth++ == 0) {
+        atomic_store(&reader->epoch, atomic_load(&registry->epoch));
+    }
+
+    return atomic_load(&registry->current);
+}
+
+void registry_read_end(struct registry * registry) {
+    struct registry_reader * reader = pthread_getspecific(registry->key);
+
+    if (--reader->depth == 0) {
+        atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    }
+}
+
+// registry lock must be held
+static void registry_retire(struct registry * registry, void * pointer, bool snapshot, uint64_t epoch) {
+    struct registry_retired * retired = malloc(sizeof(struct registry_retired));
+
+    retired->pointer = pointer;
+    retired->snapshot = snapshot;
+    retired->epoch = epoch;
+    retired->next = registry->retired;
+
+    registry->retired = retired;
+    atomic_fetch_add(&registry->retired_count, 1);
+}
+
+// registry lock must be held
+static void registry_reclaim(struct registry * registry) {
+    uint64_t oldest = UINT64_MAX;
+
+    for (struct registry_reader * reader = atomic_load(&registry->readers); reader; reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    struct registry_retired ** link = &registry->retired;
+
+    while (*link) {
+        struct registry_retired * retired = *link;
+
+        // readers that entered at an earlier epoch could still hold it
+        if (retired->epoch > oldest) {
+            link = &retired->next;
+            continue;
+        }
+
+        if (retired->snapshot) {
+            free(retired->pointer);
+        } else {
+            registry->free_item(retired->pointer);
+        }
+
+        *link = retired->next;
+        free(retired);
+        atomic_fetch_sub(&registry->retired_count, 1);
+    }
+}
+
+// registry lock must be held, the old snapshot and the removed item are retired together
+static void registry_publish(struct registry * registry, struct registry_snapshot * snapshot, void * removed) {
+    struct registry_snapshot * old = atomic_exchange(&registry->current, snapshot);
+
+    // readers entering from now on see the epoch after the change and cannot get the old snapshot
+    uint64_t epoch = atomic_fetch_add(&registry->epoch, 1) + 1;
+
+    registry_retire(registry, old, true, epoch);
+
+    if (removed) {
+        registry_retire(registry, removed, false, epoch);
+    }
+
+    registry_reclaim(registry);
+}
+
+void registry_add(struct registry * registry, void * item) {
+    pthread_mutex_lock(&registry->lock);
+
+    struct registry_snapshot * old = atomic_load(&registry->current);
+    struct registry_snapshot * snapshot = registry_snapshot_new(old->count + 1);
+
+    memcpy(snapshot->items, old->items, sizeof(void *) * old->count);
+    snapshot->items[old->count] = item;
+
+    registry_publish(registry, snapshot, NULL);
+
+    pthread_mutex_unlock(&registry->lock);
+}
+
+void registry_remove(struct registry * registry, void * item) {
+    pthread_mutex_lock(&registry->lock);
+
+    struct registry_snapshot * old = atomic_load(&registry->current);
+    struct registry_snapshot * snapshot = registry_snapshot_new(old->count);
+    size_t count = 0;
+
+    for (size_t i = 0; i < old->count; ++i) {
+        if (old->items[i] != item) {
+            snapshot->items[count++] = old->items[i];
+        }
+    }
+
+    snapshot->count = count;
+
+    if (count < old->count) {
+        registry_publish(registry, snapshot, item);
+    } else {
+        free(snapshot);
+    }
+
+    pthread_mutex_unlock(&registry->lock);
+}
+
+void registry_collect(struct registry * registry) {
+    if (atomic_load_explicit(&registry->retired_count, memory_order_relaxed) == 0 ||
+        pthread_mutex_trylock(&registry->lock) != 0) {
+        return;
+    }
+
+    registry_reclaim(registry);
+
+    pthread_mutex_unlock(&registry->lock);
+}
+
+void registry_free(struct registry * registry) {
+    while (registry->retired) {
+        struct registry_retired * retired = registry->retired;
+
+        if (retired->snapshot) {
+            free(retired->pointer);
+        } else {
+            registry->free_item(retired->pointer);
+        }
+
+        registry->retired = retired->next;
+        free(retired);
+    }
+
+    free(atomic_load(&registry->current));
+
+    struct registry_reader * reader = atomic_load(&registry->readers);
+
+    while (reader) {
+        struct registry_reader * next = reader->next;
+
+        // pairs with the release of a finished thread
+        atomic_load_explicit(&reader->in_use, memory_order_acquire);
+        free(reader);
+        reader = next;
+    }
+
+    pthread_key_delete(registry->key);
+    pthread_mutex_destroy(&registry->lock);
+}
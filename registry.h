@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef void (* registry_free_callback)(void * item);
+
+// the items registered at some moment, never changed once published
+struct registry_snapshot {
+    size_t count;
+    void * items[];
+};
+
+// a thread that reads snapshots, 0 in the epoch means it is outside of any read section
+struct registry_reader {
+    struct registry_reader * next;
+    atomic_bool in_use;
+    _Atomic uint64_t epoch;
+    unsigned depth;
+};
+
+// an old snapshot or a removed item waiting until no reader can see it
+struct registry_retired {
+    struct registry_retired * next;
+    void * pointer;
+    bool snapshot;
+    uint64_t epoch;
+};
+
+/*
+ * Set of items that is iterated much more often than changed, e.g. the connected clients.
+ * Readers iterate an immutable snapshot: entering a read section is a store of the global epoch
+ * to the slot of the thread and a load of the current snapshot, nothing is locked.
+ * Adding and removing copy the snapshot and publish the copy under a lock that readers never take.
+ * Old snapshots and removed items are retired with the epoch after the change and freed once
+ * every reader inside a read section has entered it at that epoch or later (epoch-based reclamation).
+ */
+struct registry {
+    _Atomic(struct registry_snapshot *) current;
+    _Atomic uint64_t epoch;
+
+    _Atomic(struct registry_reader *) readers;
+    pthread_key_t key;
+
+    // guards changes and the retired list
+    pthread_mutex_t lock;
+    struct registry_retired * retired;
+    atomic_size_t retired_count;
+
+    registry_free_callback free_item;
+};
+
+void registry_init(struct registry * registry, registry_free_callback free_item);
+void registry_add(struct registry * registry, void * item);
+// the item is freed with the callback once no reader can see it anymore
+void registry_remove(struct registry * registry, void * item);
+// read sections may nest, the snapshot stays valid until the matching registry_read_end
+const struct registry_snapshot * registry_read_begin(struct registry * registry);
+void registry_read_end(struct registry * registry);
+// frees what is no longer visible, returns at once if a change is in progress
+void registry_collect(struct registry * registry);
+// no thread may read any more, items still registered are not freed
+void registry_free(struct registry * registry);
@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+struct ring_cell {
+    atomic_size_t sequence;
+    alignas(max_align_t) char data[];
+};
+
+static struct ring_cell * ring_cell(const struct ring * ring, size_t position) {
+    return (struct ring_cell *) (ring->cells + (position & (ring->capacity - 1)) * ring->stride);
+}
+
+void ring_init(struct ring * ring, size_t capacity, size_t element_size) {
+    size_t alignment = alignof(max_align_t);
+
+    ring->capacity = 1;
+
+    while (ring->capacity < capacity) {
+        ring->capacity *= 2;
+    }
+
+    ring->element_size = element_size;
+    ring->stride = (sizeof(struct ring_cell) + element_size + alignment - 1) & ~(alignment - 1);
+    ring->cells = aligned_alloc(alignment, ring->stride * ring->capacity);
+
+    // a cell is free for the producer of position p while its sequence is p
+    for (size_t i = 0; i < ring->capacity; ++i) {
+        atomic_init(&ring_cell(ring, i)->sequence, i);
+    }
+
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+}
+
+bool ring_push(struct ring * ring, const void * element) {
+    size_t position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    struct ring_cell * cell;
+
+    while (true) {
+        cell = ring_cell(ring, position);
+
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        ptrdiff_t difference = (ptrdiff_t) sequence - (ptrdiff_t) position;
+
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            // the consumer has not taken the element pushed a lap ago
+            return false;
+        } else {
+            position = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell->data, element, ring->element_size);
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    return true;
+}
+
+size_t ring_pop(struct ring * ring, void * elements, size_t max) {
+    size_t count = 0;
+
+    while (count < max) {
+        struct ring_cell * cell = ring_cell(ring, ring->head);
+
+        // a producer that claimed the position but has not published it yet stops the batch
+        if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != ring->head + 1) {
+            break;
+        }
+
+        memcpy((char *) elements + count * ring->element_size, cell->data, ring->element_size);
+        atomic_store_explicit(&cell->sequence, ring->head + ring->capacity, memory_order_release);
+
+        ++ring->head;
+        ++count;
+    }
+
+    return count;
+}
+
+void ring_free(struct ring * ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
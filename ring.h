@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Bounded lock-free multi-producer single-consumer ring of fixed-size elements.
+ * Every cell carries a sequence number telling whose turn it is: producers claim positions
+ * with one compare-and-swap on the tail and publish the element by advancing the sequence,
+ * the consumer takes published elements in position order without any atomic read-modify-write.
+ */
+struct ring {
+    size_t capacity; // a power of two
+    size_t element_size;
+    size_t stride;
+    char * cells;
+
+    // producers and the consumer write different cache lines
+    alignas(64) atomic_size_t tail;
+    alignas(64) size_t head;
+};
+
+void ring_init(struct ring * ring, size_t capacity, size_t element_size);
+// copies the element in, returns false if the ring is full
+bool ring_push(struct ring * ring, const void * element);
+// consumer only, copies up to max elements out in the order they were pushed and returns their number
+size_t ring_pop(struct ring * ring, void * elements, size_t max);
+void ring_free(struct ring * ring);
@@ -1,171 +1,2247 @@
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <stdalign.h>
+#include <sched.h>
+#include <limits.h>
+
+#include "terminal.h"
+#include "message_store.h"
+#include "protocol.h"
+#include "frame.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "author_table.h"
+#include "metrics.h"
+#include "registry.h"
+#include "ring.h"
+#include "uring.h"
+#include "subscriptions.h"
+
+#define INPUT_BUFFER_SIZE 4096
+#define MAX_EVENTS 256
+#define DEFAULT_HIGH_WATER_MARK (1024 * 1024)
+#define DEFAULT_DURABILITY_INTERVAL 10
+#define INGEST_RING_CAPACITY (64 * 1024)
+#define SEQUENCER_BATCH 256
+#define INBOX_CAPACITY (16 * 1024)
+#define DEFAULT_REACTORS 1
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+// sends at least this large let the kernel read the frames in place instead of copying them
+#define URING_ZERO_COPY_MIN (64 * 1024)
+
+enum server_mode {
+    SERVER_MODE_EPOLL,
+    // the reactors submit reads and writes through io_uring, epoll is used if the kernel does not support it
+    SERVER_MODE_URING,
+    SERVER_MODE_THREADS,
+};
+
+// what a completion of the io_uring backend belongs to, kept in the low bits of its user data
+enum uring_request {
+    URING_ACCEPT,
+    URING_WAKEUP,
+    URING_RECEIVE,
+    URING_SEND,
+};
+
+// what happens to a client whose output queue grows over the high-water mark
+enum slow_consumer_policy {
+    // unsent frames are dropped starting from the oldest one
+    SLOW_CONSUMER_DROP_OLDEST,
+    // live frames are not queued anymore, the client catches up from the history once the queue drains
+    SLOW_CONSUMER_COALESCE,
+    SLOW_CONSUMER_DISCONNECT,
+};
+
+struct server_options {
+    enum server_mode mode;
+    size_t high_water_mark;
+    enum slow_consumer_policy policy;
+
+    // message log, history is kept only in memory without it
+    const char * log_path;
+    unsigned durability_interval;
+
+    // epoll mode event loops, each on a core of its own with its own listener and connections, 0 - one per core
+    unsigned reactors;
+
+    // unix socket answering every connection with the stats, none without it
+    const char * stats_path;
+    // received messages printed per second, 0 - none
+    unsigned log_rate;
+};
+
+// the username a connection registered with its hello, the name lives in the author table
+struct author {
+    uint32_t id;
+    const char * name;
+    size_t length;
+};
+
+// a message received from a client that has no id yet, reader threads pass it to the sequencer by value through
+// the ingest ring; the text is malloc'd by the reader and the sequencer copies it into the store arena and frees it.
+// A post without text announces a new author, it goes before every post of the author
+struct post {
+    long long received_at;
+    long long reply_id;
+    struct author author;
+    char * text;
+    size_t text_length;
+};
+
+// a message of a sequenced batch, the slice holds a reference of its own; an id of 0 is the frame of a new author
+struct broadcast {
+    long long id;
+    // the id itself for a new thread
+    long long root_id;
+    long long received_at;
+    struct frame_slice slice;
+};
+
+// a shard of the clients, in epoll mode an event loop thread with a SO_REUSEPORT listener of its own,
+// the threads mode has a single one without a thread
+struct reactor {
+    struct server_context * context;
+    unsigned index;
+    pthread_t thread;
+
+    int listener;
+    int epoll;
+    // the sequencer writes to it once the inbox has messages, notified is set until the reactor drains the inbox
+    int wakeup;
+    atomic_bool notified;
+
+    // broadcasts iterate a snapshot of it without locks, a removed connection is freed once no broadcast can reach it
+    struct registry clients;
+    // client threads of threads mode that may still use the reactor, they are detached and never joined
+    atomic_size_t client_threads;
+
+    // sequenced messages the reactor fans out to its own clients, the sequencer is the only producer
+    struct ring inbox;
+
+    // thread root id -> connections of the shard that get its replies, the lock is only contended in threads mode
+    struct subscriptions subscriptions;
+    pthread_mutex_t subscriptions_lock;
+    // connections the fan-out has marked messages of the current batch for
+    struct {
+        struct connection ** items;
+        size_t count;
+        size_t capacity;
+    } marked;
+
+    // io_uring mode only
+    struct uring uring;
+    struct uring_buffers buffers;
+    uint64_t wakeup_value;
+    // connections with output to send, all of them are submitted at once before the reactor waits again
+    struct {
+        struct connection ** items;
+        size_t count;
+        size_t capacity;
+    } sends;
+};
+
+// the replies of a thread in id order, slots are given in id order, so they are only appended
+struct thread_replies {
+    int32_t * slots;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct server_context {
+    struct server_options options;
+
+    struct reactor * reactors;
+    unsigned reactor_count;
+
+    // guards the message store, prev_id, the roots, the log and the snapshot
+    pthread_mutex_t lock;
+
+    // posts of all connections on their way to the sequencer, the only thread that gives ids
+    struct {
+        struct ring ring;
+        pthread_t sequencer;
+        // the sequencer sleeps on the condition while the ring is empty
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        atomic_bool sleeping;
+    } ingest;
+
+    // every username is kept once, messages and frames refer to it by id
+    struct author_table authors;
+    // guards the table and the greeting of a connection, so a welcome has every name added before it; a client greeted
+    // earlier learns a new name from the sequencer, no socket is written under it
+    pthread_mutex_t authors_lock;
+
+    long long prev_id;
+    // names the history for the clients, it comes from the log or is new with every start without one
+    uint64_t history_id;
+    struct message_store store;
+    // slots of the roots in id order, lazy joins walk them instead of the whole history; the replies of each thread
+    // are next to its root, so fetches and replays find their part of a thread by binary search
+    struct {
+        int32_t * slots;
+        struct thread_replies * replies;
+        size_t count;
+        size_t capacity;
+    } roots;
+
+    // appended under the store lock, so records go in id order
+    struct journal * journal;
+
+    // every message encoded once, broadcasts and replays send slices of it
+    struct snapshot snapshot;
+    // the roots once more, lazy joins stream them the same way
+    struct snapshot root_snapshot;
+
+    struct metrics metrics;
+    long long started;
+
+    // the second the log is limited in and how many messages it has printed in it
+    struct {
+        pthread_mutex_t lock;
+        long long second;
+        unsigned count;
+    } log;
+
+    // set by the console, every other thread polls it
+    atomic_bool closing;
+    // the console and the stats socket, joined before the context goes
+    pthread_t console;
+    pthread_t stats;
+};
+
+// a connected client, used both by the epoll reactors and by the threads mode
+struct connection {
+    struct server_context * server_context;
+    // the shard that owns the socket
+    struct reactor * reactor;
+    int socket;
+
+    struct protocol_reader input;
+
+    // frames are queued by reference, other reader threads append to it in threads mode
+    struct output_queue output;
+    pthread_mutex_t lock;
+
+    // history is streamed from the store, live frames with ids from next_id on are not queued while it is active
+    struct {
+        bool active;
+        long long next_id;
+        // only roots with thread summaries and the threads the connection is subscribed to are replayed
+        bool lazy;
+    } replay;
+
+    // the client has sent the hello with its username and the last message id it already has
+    bool greeted;
+    struct author author;
+
+    // the threads whose replies the connection gets, replies to the other threads are only counted in activity frames
+    struct {
+        // every reply, set by a subscription to root id 0; connection lock
+        bool all;
+        // subscriptions lock
+        long long * roots;
+        size_t count;
+        size_t capacity;
+        // live messages from this id on may have been left out; connection lock
+        long long filtered_from;
+        // messages of the batch being fanned out the connection gets as a subscriber, only the fan-out uses them
+        bool marked;
+        uint64_t batch[SEQUENCER_BATCH / 64];
+    } subscriptions;
+
+    size_t dropped_frames;
+    // the reader thread of threads mode checks it without the lock
+    atomic_bool closing;
+
+    // io_uring requests of the connection the kernel still holds, a closed connection is removed once there are none
+    unsigned operations;
+    struct {
+        bool scheduled; // in the send list of the reactor
+        bool active;
+        bool zero_copy;
+        int result;     // of a zero-copy send that waits for its notification
+        struct msghdr message;
+        struct iovec iov[OUTPUT_QUEUE_IOVECS];
+    } send;
+};
+
+// the reactor of the current thread, the io_uring backend submits requests only from the owner of the connection
+static _Thread_local struct reactor * current_reactor;
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static struct connection * connection_new(struct reactor * reactor, int socket) {
+    struct connection * connection = malloc(sizeof(struct connection));
+
+    connection->server_context = reactor->context;
+    connection->reactor = reactor;
+    connection->socket = socket;
+
+    // every accepted socket comes through here; fan-out frames are small and must not wait for a delayed ACK
+    int nodelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    protocol_reader_init(&connection->input, INPUT_BUFFER_SIZE);
+
+    output_queue_init(&connection->output);
+    pthread_mutex_init(&connection->lock, NULL);
+
+    // nothing is sent before the hello tells where the history has to start
+    connection->replay.active = true;
+    connection->replay.next_id = 1;
+    connection->replay.lazy = false;
+    connection->greeted = false;
+    connection->author.id = AUTHOR_TABLE_NONE;
+    connection->author.name = NULL;
+    connection->author.length = 0;
+
+    connection->subscriptions.all = false;
+    connection->subscriptions.roots = NULL;
+    connection->subscriptions.count = 0;
+    connection->subscriptions.capacity = 0;
+    connection->subscriptions.filtered_from = LLONG_MAX;
+    connection->subscriptions.marked = false;
+    memset(connection->subscriptions.batch, 0, sizeof(connection->subscriptions.batch));
+
+    connection->dropped_frames = 0;
+    connection->closing = false;
+
+    connection->operations = 0;
+    connection->send.scheduled = false;
+    connection->send.active = false;
+
+    return connection;
+}
+
+// the socket is closed only here, so a broadcast never writes to a descriptor that was reused
+static void connection_free(void * param) {
+    struct connection * connection = param;
+
+    close(connection->socket);
+
+    output_queue_free(&connection->output);
+    pthread_mutex_destroy(&connection->lock);
+
+    protocol_reader_free(&connection->input);
+    free(connection->subscriptions.roots);
+    free(connection);
+}
+
+// the owner of the connection notices the shutdown as EOF and closes it
+static void connection_shutdown(struct connection * connection) {
+    if (!connection->closing) {
+        connection->closing = true;
+        shutdown(connection->socket, SHUT_RDWR);
+    }
+}
+
+// io_uring mode puts the connection into the send list of its reactor, output queued by another thread
+// goes out with the next send of the owner, connection lock must be held
+static void reactor_schedule_send(struct connection * connection) {
+    struct reactor * reactor = connection->reactor;
+
+    if (current_reactor != reactor || connection->send.scheduled || connection->send.active ||
+        connection->closing || connection->output.count == 0) {
+        return;
+    }
+
+    if (reactor->sends.count == reactor->sends.capacity) {
+        reactor->sends.capacity = reactor->sends.capacity ? reactor->sends.capacity * 2 : 64;
+        reactor->sends.items = realloc(reactor->sends.items, sizeof(struct connection *) * reactor->sends.capacity);
+    }
+
+    reactor->sends.items[reactor->sends.count++] = connection;
+    connection->send.scheduled = true;
+}
+
+// output_queue_flush that counts the bytes sent, connection lock must be held
+static bool connection_write(struct connection * connection) {
+    if (connection->server_context->options.mode == SERVER_MODE_URING) {
+        reactor_schedule_send(connection);
+        return true;
+    }
+
+    size_t queued = connection->output.bytes;
+    bool result = output_queue_flush(&connection->output, connection->socket);
+
+    metrics_add(&connection->server_context->metrics, METRICS_BYTES_OUT, (int64_t) (queued - connection->output.bytes));
+    return result;
+}
+
+// whether the connection gets the replies of the thread, subscriptions lock must be held
+static bool connection_subscribed(const struct connection * connection, long long root_id) {
+    for (size_t i = 0; i < connection->subscriptions.count; ++i) {
+        if (connection->subscriptions.roots[i] == root_id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// a message of the snapshot joins the pending slice if it follows it in the same frame, otherwise the pending one
+// is queued and the message starts the next one
+static void output_queue_push_merged(struct output_queue * queue, struct frame_slice * pending, struct frame_slice slice) {
+    if (pending->frame == slice.frame && pending->offset + pending->length == slice.offset) {
+        pending->length += slice.length;
+        return;
+    }
+
+    if (pending->frame) {
+        output_queue_push_slice(queue, *pending);
+    }
+
+    *pending = slice;
+    pending->frame = frame_ref(slice.frame);
+}
+
+// the first of the slots in id order with an id from the given one on, count if there is none
+static size_t slots_lower_bound(const struct message_store * store, const int32_t * slots, size_t count, long long id) {
+    size_t low = 0, high = count;
+
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+
+        if (store->ids[slots[middle]] < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+// the index of a root among the roots, roots.count if the id is not a root; context lock must be held
+static size_t server_context_find_root(struct server_context * context, long long root_id) {
+    size_t index = slots_lower_bound(&context->store, context->roots.slots, context->roots.count, root_id);
+
+    return index < context->roots.count && context->store.ids[context->roots.slots[index]] == root_id ?
+           index : context->roots.count;
+}
+
+// the summaries of the threads whose roots have ids in [from, to) as one frame, context lock must be held
+static void server_context_queue_summaries(struct server_context * context, long long from, long long to,
+                                           struct output_queue * queue) {
+    struct message_store * store = &context->store;
+    size_t low = slots_lower_bound(store, context->roots.slots, context->roots.count, from);
+    size_t length = 0, end = low;
+
+    for (; end < context->roots.count && store->ids[context->roots.slots[end]] < to; ++end) {
+        int32_t slot = context->roots.slots[end];
+        struct protocol_thread thread = {store->ids[slot], store->subtree_sizes[slot] - 1, store->latest_ids[slot]};
+
+        length += protocol_thread_length(&thread);
+    }
+
+    if (length == 0) {
+        return;
+    }
+
+    struct frame * frame = frame_new(length);
+    size_t offset = 0;
+
+    frame->control = true;
+
+    for (size_t i = low; i < end; ++i) {
+        int32_t slot = context->roots.slots[i];
+        struct protocol_thread thread = {store->ids[slot], store->subtree_sizes[slot] - 1, store->latest_ids[slot]};
+
+        offset += protocol_encode_thread(frame->data + offset, &thread);
+    }
+
+    output_queue_push(queue, frame);
+}
+
+// the lazy replay queues roots from id on until the queue holds at least limit bytes, then the replies of the same
+// range of the threads the connection follows and the summaries of the threads; returns the id of the first message
+// not queued. Connection lock and context lock must be held.
+static long long connection_queue_lazy(struct connection * connection, long long id, size_t limit) {
+    struct server_context * context = connection->server_context;
+    struct message_store * store = &context->store;
+    struct reactor * reactor = connection->reactor;
+
+    // the roots have a snapshot of their own
+    long long next = snapshot_queue(&context->root_snapshot, id, LLONG_MAX, &connection->output, limit);
+    long long end = next > context->root_snapshot.generation ? context->snapshot.generation + 1 : next;
+
+    // a client that comes back or catches up after coalescing also has threads it follows, only their replies are
+    // looked at; replies go in id order within a thread, so parents come first, neighbours share one slice
+    struct frame_slice pending = {NULL, 0, 0};
+
+    pthread_mutex_lock(&reactor->subscriptions_lock);
+
+    for (size_t i = 0; i < connection->subscriptions.count; ++i) {
+        size_t index = server_context_find_root(context, connection->subscriptions.roots[i]);
+
+        if (index == context->roots.count) {
+            continue;
+        }
+
+        const struct thread_replies * replies = &context->roots.replies[index];
+
+        for (size_t j = slots_lower_bound(store, replies->slots, replies->count, id);
+             j < replies->count && store->ids[replies->slots[j]] < end; ++j) {
+            output_queue_push_merged(&connection->output, &pending, snapshot_message(&context->snapshot, store->ids[replies->slots[j]]));
+        }
+    }
+
+    pthread_mutex_unlock(&reactor->subscriptions_lock);
+
+    if (pending.frame) {
+        output_queue_push_slice(&connection->output, pending);
+    }
+
+    server_context_queue_summaries(context, id, end, &connection->output);
+    return end;
+}
+
+// queues history from replay.next_id on until the queue reaches the high-water mark, connection lock must be held
+static void connection_replay(struct connection * connection) {
+    struct server_context * context = connection->server_context;
+
+    pthread_mutex_lock(&context->lock);
+
+    // a client that follows every thread gets the rest of the history whole, one that joined with the whole history
+    // gets it whole up to where its live messages began to be filtered; past that, e.g. after coalescing, only the
+    // roots and the threads it follows go like for a lazy client
+    if (connection->subscriptions.all) {
+        connection->replay.next_id = snapshot_queue(&context->snapshot, connection->replay.next_id, LLONG_MAX,
+                                                    &connection->output, context->options.high_water_mark);
+    } else if (!connection->replay.lazy && connection->replay.next_id < connection->subscriptions.filtered_from) {
+        connection->replay.next_id = snapshot_queue(&context->snapshot, connection->replay.next_id,
+                                                    connection->subscriptions.filtered_from,
+                                                    &connection->output, context->options.high_water_mark);
+    } else {
+        connection->replay.next_id = connection_queue_lazy(connection, connection->replay.next_id,
+                                                           context->options.high_water_mark);
+    }
+
+    // messages after this generation come as live broadcasts
+    if (connection->replay.next_id > context->snapshot.generation) {
+        connection->replay.active = false;
+
+        if (connection->replay.next_id < connection->subscriptions.filtered_from) {
+            connection->subscriptions.filtered_from = connection->replay.next_id;
+        }
+    }
+
+    pthread_mutex_unlock(&context->lock);
+}
+
+// writes out as much as the socket accepts, refilling the queue from the history while a replay is active
+static void connection_flush(struct connection * connection) {
+    pthread_mutex_lock(&connection->lock);
+
+    while (!connection->closing) {
+        if (!connection_write(connection)) {
+            connection_shutdown(connection);
+            break;
+        }
+
+        if (connection->output.count > 0 || !connection->replay.active || !connection->greeted) {
+            break;
+        }
+
+        connection_replay(connection);
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+static bool connection_wants_write(struct connection * connection) {
+    pthread_mutex_lock(&connection->lock);
+    bool result = connection->output.count > 0 || (connection->replay.active && connection->greeted);
+    pthread_mutex_unlock(&connection->lock);
+
+    return result;
+}
+
+// the welcome and the author table go first, then only messages newer than the ones the client already has are replayed,
+// takes over the reference of the caller
+static void connection_greet(struct connection * connection, struct frame * welcome, long long last_id, bool lazy) {
+    pthread_mutex_lock(&connection->lock);
+
+    output_queue_push(&connection->output, welcome);
+
+    connection->replay.next_id = last_id > 0 ? last_id + 1 : 1;
+    connection->replay.lazy = lazy;
+    connection->greeted = true;
+
+    // a lazy client has none of the replies, a thread it subscribes to is sent whole
+    if (lazy) {
+        connection->subscriptions.filtered_from = 1;
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// author frames skip the replay state, a client that has not been greeted gets the author with the whole table later,
+// takes over the reference of the caller
+static void connection_send_author(struct connection * connection, struct frame * frame) {
+    pthread_mutex_lock(&connection->lock);
+
+    if (connection->closing || !connection->greeted) {
+        frame_unref(frame);
+    } else {
+        output_queue_push(&connection->output, frame);
+
+        if (!connection_write(connection)) {
+            connection_shutdown(connection);
+        }
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// queues the messages of a batch the connection does not get from the replay and writes them out at once:
+// the new threads, the replies it is subscribed to and the activity of the batch, if there is any
+static void connection_send_batch(struct connection * connection, const struct broadcast * batch, size_t count,
+                                  const uint64_t * threads, struct frame * activity) {
+    struct server_options * options = &connection->server_context->options;
+    const uint64_t * subscribed = connection->subscriptions.batch;
+    size_t queued = 0;
+
+    pthread_mutex_lock(&connection->lock);
+
+    if (connection->closing || connection->replay.active) {
+        pthread_mutex_unlock(&connection->lock);
+        return;
+    }
+
+    // messages before next_id are already queued by the replay, a running replay will queue all of them later
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t bit = 1ULL << (i % 64);
+
+        if (batch[i].id < connection->replay.next_id ||
+            !(connection->subscriptions.all || ((threads[i / 64] | subscribed[i / 64]) & bit))) {
+            continue;
+        }
+
+        struct frame_slice slice = batch[i].slice;
+        slice.frame = frame_ref(slice.frame);
+
+        output_queue_push_slice(&connection->output, slice);
+        ++queued;
+    }
+
+    bool notify = activity && !connection->subscriptions.all;
+
+    if (queued == 0 && !notify) {
+        pthread_mutex_unlock(&connection->lock);
+        return;
+    }
+
+    if (notify) {
+        output_queue_push(&connection->output, frame_ref(activity));
+    }
+
+    metrics_add(&connection->server_context->metrics, METRICS_MESSAGES_OUT, (int64_t) queued);
+
+    if (!connection_write(connection)) {
+        connection_shutdown(connection);
+    } else if (connection->output.bytes > options->high_water_mark) {
+        switch (options->policy) {
+            case SLOW_CONSUMER_DROP_OLDEST:
+            {
+                size_t dropped = output_queue_drop(&connection->output, options->high_water_mark);
+
+                connection->dropped_frames += dropped;
+                metrics_add(&connection->server_context->metrics, METRICS_DROPPED_FRAMES, (int64_t) dropped);
+                break;
+            }
+
+            case SLOW_CONSUMER_COALESCE:
+                connection->replay.active = true;
+                connection->replay.next_id = batch[count - 1].id + 1;
+                break;
+
+            case SLOW_CONSUMER_DISCONNECT:
+                connection_shutdown(connection);
+                break;
+        }
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// the welcome followed by every author known so far as one frame, authors lock must be held
+static struct frame * server_context_welcome(struct server_context * context, unsigned version, long long last_id) {
+    struct author_table * authors = &context->authors;
+    struct protocol_welcome welcome = {version, context->history_id, last_id};
+    char encoded[PROTOCOL_HELLO_LENGTH];
+    size_t length = protocol_encode_welcome(encoded, &welcome);
+
+    for (uint32_t id = 1; id <= authors->count; ++id) {
+        length += protocol_author_length(id, author_table_length(authors, id));
+    }
+
+    struct frame * frame = frame_new(length);
+    size_t offset = protocol_encode_welcome(frame->data, &welcome);
+
+    frame->control = true;
+
+    for (uint32_t id = 1; id <= authors->count; ++id) {
+        offset += protocol_encode_author(frame->data + offset, id, author_table_name(authors, id), author_table_length(authors, id));
+    }
+
+    return frame;
+}
+
+// the text goes to the sequencer in a buffer of its own, so readers never take the store lock
+static void server_context_new_post(struct post * post, struct connection * connection, long long reply_id,
+                                    const char * text, size_t message_length) {
+    post->text = malloc(message_length + 1);
+    memcpy(post->text, text, message_length);
+    post->text[message_length] = '\0';
+
+    post->received_at = now_ns();
+    post->reply_id = reply_id;
+    post->author = connection->author;
+    post->text_length = message_length;
+}
+
+// at most log_rate messages are printed per second, the others are only counted
+static bool server_context_log_allowed(struct server_context * context) {
+    if (context->options.log_rate == 0) {
+        return false;
+    }
+
+    long long second = now_ns() / 1000000000LL;
+    bool allowed;
+
+    pthread_mutex_lock(&context->log.lock);
+
+    if (context->log.second != second) {
+        context->log.second = second;
+        context->log.count = 0;
+    }
+
+    allowed = context->log.count < context->options.log_rate;
+
+    if (allowed) {
+        ++context->log.count;
+    }
+
+    pthread_mutex_unlock(&context->log.lock);
+
+    if (!allowed) {
+        metrics_add(&context->metrics, METRICS_LOG_SUPPRESSED, 1);
+    }
+
+    return allowed;
+}
+
+// the activity frames of the threads with replies in a batch, one frame for all of them
+static struct frame * reactor_activity(const long long * roots, const uint32_t * replies, size_t count) {
+    size_t length = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        length += protocol_activity_length(roots[i], replies[i]);
+    }
+
+    struct frame * frame = frame_new(length);
+    size_t offset = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        offset += protocol_encode_activity(frame->data + offset, roots[i], replies[i]);
+    }
+
+    return frame;
+}
+
+// marks the replies of a batch for the subscribers of their threads and counts the replies per thread,
+// returns the number of threads with replies; registry read section must be held, so marked connections stay alive
+static size_t reactor_mark_subscribers(struct reactor * reactor, const struct broadcast * batch, size_t count,
+                                       uint64_t * threads, long long * roots, uint32_t * replies) {
+    size_t active = 0;
+
+    pthread_mutex_lock(&reactor->subscriptions_lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t bit = 1ULL << (i % 64);
+
+        if (batch[i].root_id == batch[i].id) {
+            threads[i / 64] |= bit;
+            continue;
+        }
+
+        // replies of a batch mostly go to a few threads, the latest ones are looked at first
+        size_t thread = active;
+
+        while (thread > 0 && roots[thread - 1] != batch[i].root_id) {
+            --thread;
+        }
+
+        if (thread == 0) {
+            roots[active] = batch[i].root_id;
+            replies[active++] = 1;
+        } else {
+            ++replies[thread - 1];
+        }
+
+        const struct subscription * subscription = subscriptions_find(&reactor->subscriptions, batch[i].root_id);
+
+        for (size_t s = 0; subscription && s < subscription->count; ++s) {
+            struct connection * connection = subscription->subscribers[s];
+
+            if (!connection->subscriptions.marked) {
+                if (reactor->marked.count == reactor->marked.capacity) {
+                    reactor->marked.capacity = reactor->marked.capacity ? reactor->marked.capacity * 2 : 64;
+                    reactor->marked.items = realloc(reactor->marked.items, sizeof(struct connection *) * reactor->marked.capacity);
+                }
+
+                reactor->marked.items[reactor->marked.count++] = connection;
+                connection->subscriptions.marked = true;
+            }
+
+            connection->subscriptions.batch[i / 64] |= bit;
+        }
+    }
+
+    pthread_mutex_unlock(&reactor->subscriptions_lock);
+
+    return active;
+}
+
+// queues a batch for the clients of the shard: new threads go to everyone, replies to the subscribers of their threads
+static void reactor_fan_out(struct reactor * reactor, const struct broadcast * batch, size_t count) {
+    struct server_context * context = reactor->context;
+    long long start = now_ns();
+    uint64_t threads[SEQUENCER_BATCH / 64] = {0};
+    long long roots[SEQUENCER_BATCH];
+    uint32_t replies[SEQUENCER_BATCH];
+
+    const struct registry_snapshot * clients = registry_read_begin(&reactor->clients);
+
+    size_t active = reactor_mark_subscribers(reactor, batch, count, threads, roots, replies);
+    struct frame * activity = active > 0 ? reactor_activity(roots, replies, active) : NULL;
+
+    for (size_t i = 0; i < clients->count; ++i) {
+        connection_send_batch(clients->items[i], batch, count, threads, activity);
+    }
+
+    for (size_t i = 0; i < reactor->marked.count; ++i) {
+        struct connection * connection = reactor->marked.items[i];
+
+        connection->subscriptions.marked = false;
+        memset(connection->subscriptions.batch, 0, sizeof(connection->subscriptions.batch));
+    }
+
+    reactor->marked.count = 0;
+
+    registry_read_end(&reactor->clients);
+
+    if (activity) {
+        frame_unref(activity);
+    }
+
+    long long end = now_ns();
+
+    metrics_record(&context->metrics, METRICS_FANOUT, (uint64_t) (end - start));
+
+    for (size_t i = 0; i < count; ++i) {
+        metrics_record(&context->metrics, METRICS_INGEST_TO_BROADCAST, (uint64_t) (end - batch[i].received_at));
+    }
+}
+
+// wakes the reactor up unless it has not drained the inbox since the last wakeup
+static void reactor_notify(struct reactor * reactor) {
+    if (!atomic_exchange(&reactor->notified, true)) {
+        uint64_t one = 1;
+
+        if (write(reactor->wakeup, &one, sizeof(one)) < 0) {
+            // the counter cannot overflow, the reactor reads it on every wakeup
+        }
+    }
+}
+
+// new authors go to every greeted client of the shard, the messages around them keep their order
+static void reactor_deliver(struct reactor * reactor, const struct broadcast * batch, size_t count) {
+    size_t start = 0;
+
+    for (size_t i = 0; i <= count; ++i) {
+        if (i < count && batch[i].id != 0) {
+            continue;
+        }
+
+        if (i > start) {
+            reactor_fan_out(reactor, batch + start, i - start);
+        }
+
+        if (i < count) {
+            const struct registry_snapshot * clients = registry_read_begin(&reactor->clients);
+
+            for (size_t j = 0; j < clients->count; ++j) {
+                connection_send_author(clients->items[j], frame_ref(batch[i].slice.frame));
+            }
+
+            registry_read_end(&reactor->clients);
+        }
+
+        start = i + 1;
+    }
+}
+
+// fans out everything the sequencer has put into the inbox
+static void reactor_drain_inbox(struct reactor * reactor) {
+    struct broadcast batch[SEQUENCER_BATCH];
+    size_t count;
+
+    // a message pushed after this store notifies again, so none can be left behind
+    atomic_store(&reactor->notified, false);
+
+    while ((count = ring_pop(&reactor->inbox, batch, SEQUENCER_BATCH)) > 0) {
+        reactor_deliver(reactor, batch, count);
+
+        for (size_t i = 0; i < count; ++i) {
+            frame_unref(batch[i].slice.frame);
+        }
+    }
+}
+
+// every shard gets its own references to the batch, the shard of threads mode has no thread and is fanned out at once
+static void server_context_broadcast(struct server_context * context, const struct broadcast * batch, size_t count) {
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        struct reactor * reactor = &context->reactors[r];
+
+        if (context->options.mode == SERVER_MODE_THREADS) {
+            reactor_deliver(reactor, batch, count);
+            continue;
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            struct broadcast message = batch[i];
+            message.slice.frame = frame_ref(message.slice.frame);
+
+            while (!ring_push(&reactor->inbox, &message)) {
+                // a stopped reactor never drains its inbox, clients are disconnected anyway
+                if (context->closing) {
+                    frame_unref(message.slice.frame);
+                    break;
+                }
+
+                reactor_notify(reactor);
+                sched_yield();
+            }
+        }
+
+        reactor_notify(reactor);
+    }
+}
+
+// remembers a new thread or adds a reply to its thread, context lock must be held
+static void server_context_index_message(struct server_context * context, int32_t slot) {
+    struct message_store * store = &context->store;
+
+    if (store->parents[slot] != MESSAGE_STORE_NONE) {
+        struct thread_replies * replies = &context->roots.replies[server_context_find_root(context, store->ids[store->roots[slot]])];
+
+        if (replies->count == replies->capacity) {
+            replies->capacity = replies->capacity ? replies->capacity * 2 : 16;
+            replies->slots = realloc(replies->slots, sizeof(int32_t) * replies->capacity);
+        }
+
+        replies->slots[replies->count++] = slot;
+        return;
+    }
+
+    frame_unref(snapshot_append(&context->root_snapshot, store->ids[slot], 0, store->authors[slot],
+                                store->texts[slot], store->text_lengths[slot]).frame);
+
+    if (context->roots.count == context->roots.capacity) {
+        context->roots.capacity = context->roots.capacity ? context->roots.capacity * 2 : 1024;
+        context->roots.slots = realloc(context->roots.slots, sizeof(int32_t) * context->roots.capacity);
+        context->roots.replies = realloc(context->roots.replies, sizeof(struct thread_replies) * context->roots.capacity);
+    }
+
+    context->roots.slots[context->roots.count] = slot;
+    context->roots.replies[context->roots.count] = (struct thread_replies) {NULL, 0, 0};
+    ++context->roots.count;
+}
+
+// gives ids to a batch of posts and hands it to the shards, runs on the sequencer thread only
+static void server_context_add_messages(struct server_context * context, const struct post * posts, size_t count) {
+    struct broadcast batch[SEQUENCER_BATCH];
+    long long reply_ids[SEQUENCER_BATCH];
+
+    // the whole batch goes into the store, the log and the snapshot under one lock
+    pthread_mutex_lock(&context->lock);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct post * post = &posts[i];
+        long long id = ++context->prev_id;
+        char * text = message_store_alloc_text(&context->store, post->text_length);
+
+        memcpy(text, post->text, post->text_length);
+
+        int32_t slot = message_store_add(&context->store, id, post->reply_id, post->author.id, text, post->text_length);
+        server_context_index_message(context, slot);
+
+        // a reply to an unknown message becomes a new thread
+        long long reply_id = context->store.parents[slot] == MESSAGE_STORE_NONE ? 0 : post->reply_id;
+
+        if (context->journal) {
+            journal_append(context->journal, id, reply_id, post->author.name, post->author.length, post->text, post->text_length);
+        }
+
+        // the message is encoded once into the snapshot and every client only gets a reference to it
+        batch[i].id = id;
+        batch[i].root_id = context->store.ids[context->store.roots[slot]];
+        batch[i].received_at = post->received_at;
+        batch[i].slice = snapshot_append(&context->snapshot, id, reply_id, post->author.id, post->text, post->text_length);
+        reply_ids[i] = reply_id;
+    }
+
+    // with a durability interval of 0 the batch is synced once, before replays under the lock or the broadcast see it
+    if (context->journal) {
+        journal_commit(context->journal);
+    }
+
+    pthread_mutex_unlock(&context->lock);
+
+    server_context_broadcast(context, batch, count);
+
+    metrics_record(&context->metrics, METRICS_BATCH_SIZE, count);
+
+    for (size_t i = 0; i < count; ++i) {
+        const struct post * post = &posts[i];
+
+        frame_unref(batch[i].slice.frame);
+
+        if (server_context_log_allowed(context)) {
+            if (reply_ids[i]) {
+                printf("Message from %s as a reply to %lld: %s\n", post->author.name, reply_ids[i], post->text);
+            } else {
+                printf("Message from %s: %s\n", post->author.name, post->text);
+            }
+        }
+
+        free(post->text);
+    }
+}
+
+// the new authors of a batch go out as one frame ahead of its messages, by the way the messages take, so every
+// shard has them before the first post with one of the names; the texts are sequenced as one batch after it
+static void server_context_sequence(struct server_context * context, struct post * posts, size_t count) {
+    size_t length = 0, messages = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!posts[i].text) {
+            length += protocol_author_length(posts[i].author.id, posts[i].author.length);
+        }
+    }
+
+    if (length > 0) {
+        struct frame * frame = frame_new(length);
+        size_t offset = 0;
+
+        for (size_t i = 0; i < count; ++i) {
+            if (!posts[i].text) {
+                offset += protocol_encode_author(frame->data + offset, posts[i].author.id, posts[i].author.name,
+                                                 posts[i].author.length);
+            }
+        }
+
+        frame->control = true;
+
+        struct broadcast announcement = {0, 0, now_ns(), {frame, 0, length}};
+        server_context_broadcast(context, &announcement, 1);
+
+        frame_unref(frame);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (posts[i].text) {
+            posts[messages++] = posts[i];
+        }
+    }
+
+    if (messages > 0) {
+        server_context_add_messages(context, posts, messages);
+    }
+}
+
+// drains the ingest ring in batches until the server is closing and the ring is empty
+static void * server_sequencer(void * param) {
+    struct server_context * context = param;
+    struct post posts[SEQUENCER_BATCH];
+
+    while (true) {
+        size_t count = ring_pop(&context->ingest.ring, posts, SEQUENCER_BATCH);
+
+        if (count > 0) {
+            server_context_sequence(context, posts, count);
+            continue;
+        }
+
+        if (context->closing) {
+            break;
+        }
+
+        // a producer that sees the flag signals under the lock, so the check below cannot miss its post
+        pthread_mutex_lock(&context->ingest.lock);
+        atomic_store(&context->ingest.sleeping, true);
+
+        count = ring_pop(&context->ingest.ring, posts, SEQUENCER_BATCH);
+
+        if (count == 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+
+            // the timeout lets the sequencer notice the quit command
+            deadline.tv_nsec += 100 * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+
+            pthread_cond_timedwait(&context->ingest.cond, &context->ingest.lock, &deadline);
+        }
+
+        atomic_store(&context->ingest.sleeping, false);
+        pthread_mutex_unlock(&context->ingest.lock);
+
+        if (count > 0) {
+            server_context_sequence(context, posts, count);
+        }
+    }
+
+    return NULL;
+}
+
+// hands the post to the sequencer, waits while the ring is full
+static void server_context_submit(struct server_context * context, const struct post * post) {
+    while (!ring_push(&context->ingest.ring, post)) {
+        sched_yield();
+    }
+
+    if (atomic_load(&context->ingest.sleeping)) {
+        pthread_mutex_lock(&context->ingest.lock);
+        pthread_cond_signal(&context->ingest.cond);
+        pthread_mutex_unlock(&context->ingest.lock);
+    }
+}
+
+// registers the username of the hello; a new name goes to the sequencer ahead of any post with it, so every shard
+// announces it to its greeted clients before the first message of the author. A client greeted later finds it
+// in the table of its welcome
+static void server_context_login(struct server_context * context, struct connection * connection, const struct protocol_hello * hello) {
+    pthread_mutex_lock(&context->authors_lock);
+
+    bool added;
+    uint32_t id = author_table_intern(&context->authors, hello->username, hello->username_length, &added);
+
+    connection->author.id = id;
+    connection->author.name = author_table_name(&context->authors, id);
+    connection->author.length = hello->username_length;
+
+    pthread_mutex_lock(&context->lock);
+    long long prev_id = context->prev_id;
+    pthread_mutex_unlock(&context->lock);
+
+    // the messages of a client from another history or from past the end of this one are not these messages,
+    // it gets the whole history and drops its own by the same rule
+    long long last_id = hello->history_id == context->history_id && hello->last_id <= prev_id ? hello->last_id : 0;
+
+    connection_greet(connection, server_context_welcome(context, hello->version, prev_id), last_id,
+                     (hello->flags & PROTOCOL_HELLO_LAZY) != 0);
+
+    pthread_mutex_unlock(&context->authors_lock);
+
+    if (added) {
+        struct post announcement = {now_ns(), 0, connection->author, NULL, 0};
+        server_context_submit(context, &announcement);
+    }
+
+    connection_flush(connection);
+}
+
+// rebuilds the store from the log, records come in id order
+static void server_context_restore_message(void * param, long long id, long long reply_id,
+                                           const char * author, size_t author_length,
+                                           const char * text, size_t text_length) {
+    struct server_context * context = param;
+    char * copy = message_store_alloc_text(&context->store, text_length);
+    bool added;
+    uint32_t author_id = author_table_intern(&context->authors, author, author_length, &added);
+
+    memcpy(copy, text, text_length);
+
+    server_context_index_message(context, message_store_add(&context->store, id, reply_id, author_id, copy, text_length));
+    context->prev_id = id;
+
+    frame_unref(snapshot_append(&context->snapshot, id, reply_id, author_id, text, text_length).frame);
+}
+
+// the connection must not be used by the caller afterwards, it is freed once no broadcast can see it
+static void server_context_remove_client(struct server_context * context, struct connection * connection) {
+    // broadcasts still holding the connection skip it from now on and the peer sees EOF at once
+    pthread_mutex_lock(&connection->lock);
+    connection_shutdown(connection);
+    pthread_mutex_unlock(&connection->lock);
+
+    // the fan-out finds subscribers through the index, so the connection leaves it before the registry
+    struct reactor * reactor = connection->reactor;
+    pthread_mutex_lock(&reactor->subscriptions_lock);
+
+    for (size_t i = 0; i < connection->subscriptions.count; ++i) {
+        subscriptions_remove(&reactor->subscriptions, connection->subscriptions.roots[i], connection);
+    }
+
+    connection->subscriptions.count = 0;
+    pthread_mutex_unlock(&reactor->subscriptions_lock);
+
+    registry_remove(&connection->reactor->clients, connection);
+
+    metrics_add(&context->metrics, METRICS_CONNECTIONS_CLOSED, 1);
+}
+
+// adds the connection to the subscribers of a thread, subscriptions lock must be held
+static bool connection_add_subscription(struct connection * connection, long long root_id) {
+    if (!subscriptions_add(&connection->reactor->subscriptions, root_id, connection)) {
+        return false;
+    }
+
+    if (connection->subscriptions.count == connection->subscriptions.capacity) {
+        connection->subscriptions.capacity = connection->subscriptions.capacity ? connection->subscriptions.capacity * 2 : 8;
+        connection->subscriptions.roots = realloc(connection->subscriptions.roots,
+                                                  sizeof(long long) * connection->subscriptions.capacity);
+    }
+
+    connection->subscriptions.roots[connection->subscriptions.count++] = root_id;
+    return true;
+}
+
+// the replies of a thread from the given id on, which the client may not have, as slices of the snapshot; replies
+// are listed in id order, so parents go first. Messages the running replay is going to send are left to it,
+// connection lock must be held
+static void connection_catch_up(struct connection * connection, long long root_id, long long from) {
+    struct server_context * context = connection->server_context;
+    struct message_store * store = &context->store;
+    long long until = connection->replay.active ? connection->replay.next_id : LLONG_MAX;
+    struct frame_slice pending = {NULL, 0, 0};
+
+    pthread_mutex_lock(&context->lock);
+
+    size_t index = server_context_find_root(context, root_id);
+
+    if (index < context->roots.count) {
+        const struct thread_replies * replies = &context->roots.replies[index];
+
+        for (size_t i = slots_lower_bound(store, replies->slots, replies->count, from);
+             i < replies->count && store->ids[replies->slots[i]] < until; ++i) {
+            output_queue_push_merged(&connection->output, &pending, snapshot_message(&context->snapshot, store->ids[replies->slots[i]]));
+        }
+    }
+
+    pthread_mutex_unlock(&context->lock);
+
+    if (pending.frame) {
+        output_queue_push_slice(&connection->output, pending);
+    }
+}
+
+// a client that starts following every thread gets the replies left out from the given id on, but for the threads
+// it has already been subscribed to; slots are given in id order together with the ids. Connection lock must be held.
+static void connection_catch_up_all(struct connection * connection, long long from) {
+    struct server_context * context = connection->server_context;
+    struct message_store * store = &context->store;
+    struct reactor * reactor = connection->reactor;
+    long long until = connection->replay.active ? connection->replay.next_id : LLONG_MAX;
+    struct frame_slice pending = {NULL, 0, 0};
+
+    pthread_mutex_lock(&context->lock);
+    pthread_mutex_lock(&reactor->subscriptions_lock);
+
+    int32_t first = message_store_find(store, from);
+
+    for (size_t slot = first == MESSAGE_STORE_NONE ? store->count : (size_t) first;
+         slot < store->count && store->ids[slot] < until; ++slot) {
+        if (store->parents[slot] == MESSAGE_STORE_NONE || connection_subscribed(connection, store->ids[store->roots[slot]])) {
+            continue;
+        }
+
+        output_queue_push_merged(&connection->output, &pending, snapshot_message(&context->snapshot, store->ids[slot]));
+    }
+
+    pthread_mutex_unlock(&reactor->subscriptions_lock);
+    pthread_mutex_unlock(&context->lock);
+
+    if (pending.frame) {
+        output_queue_push_slice(&connection->output, pending);
+    }
+}
+
+// a new subscriber first gets the replies left out of its live broadcasts so far; the subscription is in the index
+// before they are collected, and broadcasts wait for the connection lock, so every later reply arrives after them
+static void connection_subscribe(struct connection * connection, long long root_id, bool subscribed) {
+    struct reactor * reactor = connection->reactor;
+
+    pthread_mutex_lock(&connection->lock);
+
+    if (root_id == 0) {
+        bool caught_up = connection->subscriptions.all;
+
+        connection->subscriptions.all = subscribed;
+
+        if (subscribed && !caught_up && !connection->closing) {
+            connection_catch_up_all(connection, connection->subscriptions.filtered_from);
+
+            if (!connection_write(connection)) {
+                connection_shutdown(connection);
+            }
+        }
+
+        pthread_mutex_unlock(&connection->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&reactor->subscriptions_lock);
+
+    bool changed = subscribed ? connection_add_subscription(connection, root_id) :
+                                subscriptions_remove(&reactor->subscriptions, root_id, connection);
+
+    if (changed && !subscribed) {
+        for (size_t i = 0; i < connection->subscriptions.count; ++i) {
+            if (connection->subscriptions.roots[i] == root_id) {
+                connection->subscriptions.roots[i] = connection->subscriptions.roots[--connection->subscriptions.count];
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&reactor->subscriptions_lock);
+
+    if (changed && subscribed && !connection->subscriptions.all && !connection->closing) {
+        connection_catch_up(connection, root_id, connection->subscriptions.filtered_from);
+
+        if (!connection_write(connection)) {
+            connection_shutdown(connection);
+        }
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// the next page of replies of a thread after the given id in id order, so parents always come first;
+// the last page is collected with the connection already subscribed under the store lock, so every later reply
+// arrives live after it and the client never sees a reply to a message it does not have
+static void connection_fetch(struct connection * connection, long long root_id, long long after_id) {
+    struct server_context * context = connection->server_context;
+    struct message_store * store = &context->store;
+    struct reactor * reactor = connection->reactor;
+
+    pthread_mutex_lock(&connection->lock);
+    pthread_mutex_lock(&context->lock);
+
+    size_t index = server_context_find_root(context, root_id);
+
+    if (connection->closing || index == context->roots.count) {
+        pthread_mutex_unlock(&context->lock);
+        pthread_mutex_unlock(&connection->lock);
+        return;
+    }
+
+    // the page starts right after the given id in the replies of the thread, its messages are slices of the snapshot
+    const struct thread_replies * replies = &context->roots.replies[index];
+    size_t begin = slots_lower_bound(store, replies->slots, replies->count, after_id + 1);
+    bool last = replies->count - begin <= PROTOCOL_PAGE_MESSAGES;
+    size_t end = last ? replies->count : begin + PROTOCOL_PAGE_MESSAGES;
+    struct frame_slice pending = {NULL, 0, 0};
+
+    if (last) {
+        pthread_mutex_lock(&reactor->subscriptions_lock);
+        connection_add_subscription(connection, root_id);
+        pthread_mutex_unlock(&reactor->subscriptions_lock);
+    }
+
+    for (size_t i = begin; i < end; ++i) {
+        output_queue_push_merged(&connection->output, &pending, snapshot_message(&context->snapshot, store->ids[replies->slots[i]]));
+    }
+
+    // the page may be dropped for a slow client, the place of the next one may not
+    struct frame * more = NULL;
+
+    if (!last) {
+        char encoded[PROTOCOL_SUBSCRIBE_LENGTH];
+        size_t more_length = protocol_encode_more(encoded, root_id, store->ids[replies->slots[end - 1]]);
+
+        more = frame_new(more_length);
+        memcpy(more->data, encoded, more_length);
+        more->control = true;
+    }
+
+    pthread_mutex_unlock(&context->lock);
+
+    if (pending.frame) {
+        output_queue_push_slice(&connection->output, pending);
+    }
+
+    if (more) {
+        output_queue_push(&connection->output, more);
+    }
+
+    if (begin < end || more) {
+        if (!connection_write(connection)) {
+            connection_shutdown(connection);
+        }
+    }
+
+    pthread_mutex_unlock(&connection->lock);
+}
+
+// hello, then posts, subscriptions and fetches, returns false if the connection must be closed
+static bool connection_handle_frame(struct connection * connection, const struct protocol_frame * frame) {
+    struct server_context * context = connection->server_context;
+
+    if (!connection->greeted) {
+        struct protocol_hello hello;
+
+        if (!protocol_decode_hello(frame, &hello) || hello.version < PROTOCOL_VERSION || hello.username_length == 0) {
+            return false;
+        }
+
+        server_context_login(context, connection, &hello);
+        return true;
+    }
+
+    if (frame->type == PROTOCOL_SUBSCRIBE) {
+        long long root_id;
+        bool subscribed;
+
+        if (!protocol_decode_subscribe(frame, &root_id, &subscribed)) {
+            return false;
+        }
+
+        connection_subscribe(connection, root_id, subscribed);
+        return true;
+    }
+
+    if (frame->type == PROTOCOL_FETCH) {
+        long long root_id, after_id;
+
+        if (!protocol_decode_fetch(frame, &root_id, &after_id)) {
+            return false;
+        }
+
+        connection_fetch(connection, root_id, after_id);
+        return true;
+    }
+
+    struct protocol_message message;
+
+    if (!protocol_decode_post(frame, &message)) {
+        return false;
+    }
+
+    metrics_add(&context->metrics, METRICS_MESSAGES_IN, 1);
+
+    struct post post;
+    server_context_new_post(&post, connection, message.reply_id, message.text, message.text_length);
+
+    server_context_submit(context, &post);
+    return true;
+}
+
+// handles every complete frame of the input buffer
+static bool connection_process_input(struct connection * connection) {
+    struct protocol_frame frame;
+    enum protocol_status status;
+
+    while ((status = protocol_reader_next(&connection->input, &frame)) == PROTOCOL_FRAME) {
+        if (!connection_handle_frame(connection, &frame)) {
+            return false;
+        }
+    }
+
+    return status == PROTOCOL_INCOMPLETE;
+}
+
+// feeds bytes received by the io_uring backend to the reader, returns false if the connection must be closed
+static bool connection_receive(struct connection * connection, const char * data, size_t length) {
+    metrics_add(&connection->server_context->metrics, METRICS_BYTES_IN, (int64_t) length);
+
+    while (length > 0) {
+        size_t room;
+        char * space = protocol_reader_space(&connection->input, &room);
+        size_t chunk = room < length ? room : length;
+
+        memcpy(space, data, chunk);
+        protocol_reader_commit(&connection->input, chunk);
+
+        data += chunk;
+        length -= chunk;
+
+        if (!connection_process_input(connection)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// waits for input on the non-blocking socket of threads mode and flushes the output queue meanwhile
+static void connection_wait(struct connection * connection) {
+    struct pollfd pollfd;
+    pollfd.fd = connection->socket;
+    pollfd.events = POLLIN | (connection_wants_write(connection) ? POLLOUT : 0);
+
+    // the timeout picks up frames queued by other threads after the socket filled up
+    if (poll(&pollfd, 1, 100) > 0 && (pollfd.revents & POLLOUT)) {
+        connection_flush(connection);
+    }
+}
+
+static void * listen_to_client(void * param) {
+    struct connection * context = param;
+
+    while (!context->server_context->closing && !context->closing) {
+        size_t room;
+        char * space = protocol_reader_space(&context->input, &room);
+        ssize_t ret = read(context->socket, space, room);
+
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            connection_wait(context);
+            continue;
+        }
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            break;
+        }
+
+        protocol_reader_commit(&context->input, ret);
+        metrics_add(&context->server_context->metrics, METRICS_BYTES_IN, ret);
+
+        if (!connection_process_input(context)) {
+            break;
+        }
+    }
+
+    // the connection may be gone after its removal, the reactor stays until the last thread has left it
+    struct reactor * reactor = context->reactor;
+
+    server_context_remove_client(context->server_context, context);
+    atomic_fetch_sub(&reactor->client_threads, 1);
+
+    pthread_exit(0);
+}
+
+static void server_context_add_client(struct server_context * context, struct connection * connection) {
+    registry_add(&connection->reactor->clients, connection);
+
+    metrics_add(&context->metrics, METRICS_CONNECTIONS_OPENED, 1);
+}
+
+static void handle_client(int socket, struct reactor * reactor) {
+    pthread_t tid; /* идентификатор потока */
+    pthread_attr_t attr; /* атрибуты потока */
+
+/* получаем дефолтные значения атрибутов */
+    pthread_attr_init(&attr);
+    // nobody joins them, their resources go back when they exit
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    struct connection * connection = connection_new(reactor, socket);
+
+    // the history is streamed by the reader thread, so the accept loop is not held up
+    server_context_add_client(reactor->context, connection);
+    atomic_fetch_add(&reactor->client_threads, 1);
+
+/* создаем новый поток */
+    pthread_create(&tid, &attr, listen_to_client, connection);
+}
+
+// drains the socket until EAGAIN, returns false if the connection must be closed
+static bool connection_read(struct connection * connection) {
+    while (!connection->closing) {
+        size_t room;
+        char * space = protocol_reader_space(&connection->input, &room);
+        ssize_t ret = recv(connection->socket, space, room, MSG_DONTWAIT);
+
+        if (ret == 0) {
+            return false;
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        protocol_reader_commit(&connection->input, ret);
+        metrics_add(&connection->server_context->metrics, METRICS_BYTES_IN, ret);
+
+        if (!connection_process_input(connection)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+static void connection_close(struct reactor * reactor, struct connection * connection) {
+    epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, connection->socket, NULL);
+    server_context_remove_client(reactor->context, connection);
+}
+
+static void server_accept_clients(struct reactor * reactor) {
+    while (true) {
+        int socket = accept4(reactor->listener, NULL, NULL, SOCK_NONBLOCK);
+
+        if (socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            break;
+        }
+
+        struct connection * connection = connection_new(reactor, socket);
+        server_context_add_client(reactor->context, connection);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, socket, &event);
+
+        // the history goes out as the socket drains, data could also arrive before the socket was registered
+        connection_flush(connection);
+
+        if (!connection_read(connection)) {
+            connection_close(reactor, connection);
+        }
+    }
+}
+
+// the listening socket on port 9002, the listeners of the reactors share the port and the kernel spreads connections over them
+static int server_listen(bool reuse_port) {
+    // create the server socket
+    int server_socket;
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    // a restarted server must not wait for connections of the previous one in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    if (reuse_port) {
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+
+    // define the server address
+    struct sockaddr_in server_address;
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(9002);
+    server_address.sin_addr.s_addr = INADDR_ANY;
+
+    // bind the socket to our specified IP and port
+    bind(server_socket, (struct sockaddr*) &server_address, sizeof(server_address));
+
+    // second argument is a backlog - how many connections can be waiting for this socket simultaneously
+    listen(server_socket, 255);
+
+    return server_socket;
+}
+
+// the cores the process may run on
+static unsigned server_cores(cpu_set_t * allowed) {
+    if (sched_getaffinity(0, sizeof(*allowed), allowed)) {
+        CPU_ZERO(allowed);
+        return 0;
+    }
+
+    return (unsigned) CPU_COUNT(allowed);
+}
+
+// the n-th reactor runs on the n-th allowed core, they wrap around if there are more reactors than cores
+static void reactor_pin(struct reactor * reactor) {
+    cpu_set_t allowed;
+    unsigned cores = server_cores(&allowed);
+
+    if (cores == 0) {
+        return;
+    }
+
+    unsigned target = reactor->index % cores;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+static bool reactor_init(struct reactor * reactor, struct server_context * context, unsigned index) {
+    reactor->context = context;
+    reactor->index = index;
+
+    reactor->listener = server_listen(context->options.mode != SERVER_MODE_THREADS);
+    reactor->epoll = epoll_create1(0);
+    reactor->wakeup = eventfd(0, EFD_NONBLOCK);
+    reactor->notified = false;
+    reactor->client_threads = 0;
+
+    registry_init(&reactor->clients, connection_free);
+    ring_init(&reactor->inbox, INBOX_CAPACITY, sizeof(struct broadcast));
+
+    subscriptions_init(&reactor->subscriptions);
+    pthread_mutex_init(&reactor->subscriptions_lock, NULL);
+    reactor->marked.items = NULL;
+    reactor->marked.count = 0;
+    reactor->marked.capacity = 0;
+
+    reactor->sends.items = NULL;
+    reactor->sends.count = 0;
+    reactor->sends.capacity = 0;
+
+    if (context->options.mode != SERVER_MODE_URING) {
+        return true;
+    }
+
+    if (!uring_init(&reactor->uring, URING_ENTRIES)) {
+        return false;
+    }
+
+    if (!uring_buffers_init(&reactor->buffers, &reactor->uring, 0, URING_BUFFERS, INPUT_BUFFER_SIZE)) {
+        uring_free(&reactor->uring);
+        return false;
+    }
+
+    return true;
+}
+
+// the clients are disconnected, the registry and the subscriptions stay, reader threads of threads mode may still be leaving them
+static void reactor_free(struct reactor * reactor) {
+    struct broadcast message;
+
+    while (ring_pop(&reactor->inbox, &message, 1) > 0) {
+        frame_unref(message.slice.frame);
+    }
+
+    ring_free(&reactor->inbox);
+
+    // closing the ring cancels the requests still in flight, none of them refers to a connection afterwards
+    if (reactor->context->options.mode == SERVER_MODE_URING) {
+        uring_buffers_free(&reactor->buffers, &reactor->uring);
+        uring_free(&reactor->uring);
+    }
+
+    // the connections leave the way a disconnect takes them, so connection_free stays the only place a socket
+    // is closed; the client threads of the threads mode see the shutdown and remove their connections themselves
+    bool threads = reactor->context->options.mode == SERVER_MODE_THREADS;
+    const struct registry_snapshot * clients = registry_read_begin(&reactor->clients);
+
+    for (size_t i = 0; i < clients->count; ++i) {
+        struct connection * connection = clients->items[i];
+
+        if (threads) {
+            pthread_mutex_lock(&connection->lock);
+            connection_shutdown(connection);
+            pthread_mutex_unlock(&connection->lock);
+        } else {
+            server_context_remove_client(reactor->context, connection);
+        }
+    }
+
+    registry_read_end(&reactor->clients);
+
+    for (;;) {
+        registry_collect(&reactor->clients);
+
+        size_t count = registry_read_begin(&reactor->clients)->count;
+        registry_read_end(&reactor->clients);
+
+        if (count == 0 && atomic_load(&reactor->clients.retired_count) == 0 && atomic_load(&reactor->client_threads) == 0) {
+            break;
+        }
+
+        usleep(1000);
+    }
+
+    registry_free(&reactor->clients);
+    subscriptions_free(&reactor->subscriptions);
+    pthread_mutex_destroy(&reactor->subscriptions_lock);
+
+    free(reactor->sends.items);
+    free(reactor->marked.items);
+    close(reactor->wakeup);
+    close(reactor->epoll);
+    close(reactor->listener);
+}
+
+// edge-triggered event loop of one shard owning its listener, its client sockets and its inbox
+static void * reactor_run(void * param) {
+    struct reactor * reactor = param;
+    struct server_context * context = reactor->context;
+
+    reactor_pin(reactor);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, reactor->listener, &event);
+
+    event.events = EPOLLIN;
+    event.data.ptr = reactor;
+    epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, reactor->wakeup, &event);
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!context->closing) {
+        // timeout lets the loop notice the quit command from the console
+        int count = epoll_wait(reactor->epoll, events, MAX_EVENTS, 100);
+
+        // connections removed while the console was reading the registry
+        registry_collect(&reactor->clients);
+
+        for (int i = 0; i < count; ++i) {
+            struct connection * connection = events[i].data.ptr;
+
+            if (!connection) {
+                server_accept_clients(reactor);
+                continue;
+            }
+
+            if (events[i].data.ptr == reactor) {
+                uint64_t value;
+
+                if (read(reactor->wakeup, &value, sizeof(value)) < 0) {
+                    // another wakeup has already been read together with this one
+                }
+
+                reactor_drain_inbox(reactor);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                connection_flush(connection);
+            }
 
-#include "terminal.h"
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) || !connection_read(connection)) {
+                connection_close(reactor, connection);
+            }
+        }
+    }
 
-struct message {
-    struct message * next;
+    return NULL;
+}
 
-    long long id;
-    char * author;
-    char * text;
+static uint64_t uring_user_data(void * pointer, enum uring_request request) {
+    return (uint64_t) (uintptr_t) pointer | request;
+}
 
-    struct message * children;
-};
+// a multishot accept completes once for every new connection
+static void reactor_accept(struct reactor * reactor) {
+    struct io_uring_sqe * sqe = uring_get_sqe(&reactor->uring);
 
-struct server_context {
-    struct {
-        int capacity;
-        int amount;
-        int * sockets;
-    } clients;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = reactor->listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = uring_user_data(reactor, URING_ACCEPT);
+}
 
-    long long prev_id;
-    struct message * messages;
+static void reactor_wait_wakeup(struct reactor * reactor) {
+    struct io_uring_sqe * sqe = uring_get_sqe(&reactor->uring);
 
-    bool closing;
-};
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = reactor->wakeup;
+    sqe->addr = (uint64_t) (uintptr_t) &reactor->wakeup_value;
+    sqe->len = sizeof(reactor->wakeup_value);
+    sqe->user_data = uring_user_data(reactor, URING_WAKEUP);
+}
 
-struct client_context {
-    struct server_context * server_context;
-    int socket;
-};
+// a multishot receive completes for every read with a buffer the kernel took from the buffer ring
+static void reactor_receive(struct reactor * reactor, struct connection * connection) {
+    struct io_uring_sqe * sqe = uring_get_sqe(&reactor->uring);
 
-static struct message * message_find_by_id(struct message * message, long long id) {
-    for (struct message * msg = message; msg; msg = msg->next) {
-        if (msg->id == id) {
-            return msg;
-        }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = reactor->buffers.group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = uring_user_data(connection, URING_RECEIVE);
+
+    ++connection->operations;
+}
+
+// a closed connection leaves the registry once the kernel holds no request of it and no send is about to be submitted
+static void reactor_release(struct reactor * reactor, struct connection * connection) {
+    if (connection->closing && connection->operations == 0 && !connection->send.scheduled) {
+        server_context_remove_client(reactor->context, connection);
+    }
+}
+
+// one sendmsg per connection of the list, the whole fan-out reaches the kernel with the next enter
+static void reactor_submit_sends(struct reactor * reactor) {
+    size_t submitted = 0;
+
+    for (size_t i = 0; i < reactor->sends.count; ++i) {
+        struct connection * connection = reactor->sends.items[i];
+
+        pthread_mutex_lock(&connection->lock);
+
+        connection->send.scheduled = false;
+
+        if (!connection->closing && connection->output.count > 0) {
+            struct msghdr * message = &connection->send.message;
+            size_t bytes = 0;
+
+            memset(message, 0, sizeof(*message));
+            message->msg_iov = connection->send.iov;
+            message->msg_iovlen = output_queue_gather(&connection->output, connection->send.iov, OUTPUT_QUEUE_IOVECS);
 
-        struct message * child = message_find_by_id(msg->children, id);
-        if (child) {
-            return child;
+            for (size_t j = 0; j < message->msg_iovlen; ++j) {
+                bytes += connection->send.iov[j].iov_len;
+            }
+
+            // the pinned slices keep the frames alive until the kernel is done with them
+            connection->send.zero_copy = bytes >= URING_ZERO_COPY_MIN;
+            connection->send.active = true;
+
+            struct io_uring_sqe * sqe = uring_get_sqe(&reactor->uring);
+
+            sqe->opcode = connection->send.zero_copy ? IORING_OP_SENDMSG_ZC : IORING_OP_SENDMSG;
+            sqe->fd = connection->socket;
+            sqe->addr = (uint64_t) (uintptr_t) message;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            sqe->user_data = uring_user_data(connection, URING_SEND);
+
+            ++connection->operations;
+            ++submitted;
         }
+
+        pthread_mutex_unlock(&connection->lock);
+
+        reactor_release(reactor, connection);
     }
 
-    return NULL;
+    reactor->sends.count = 0;
+
+    metrics_add(&reactor->context->metrics, METRICS_URING_SENDS, (int64_t) submitted);
 }
 
-static void server_context_add_message(struct server_context * context, long long reply_id, char * username, char * message) {
-    struct message * parent = NULL;
+static void reactor_received(struct reactor * reactor, struct connection * connection, const struct io_uring_cqe * cqe) {
+    bool alive = cqe->res > 0;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (alive && !connection->closing) {
+            alive = connection_receive(connection, uring_buffer(&reactor->buffers, id), (size_t) cqe->res);
+        }
+
+        uring_buffers_recycle(&reactor->buffers, id);
+    }
 
-    if (reply_id) {
-        parent = message_find_by_id(context->messages, reply_id);
+    // the kernel ends a multishot receive that ran out of buffers, it is simply armed again
+    if (!alive && cqe->res != -ENOBUFS) {
+        pthread_mutex_lock(&connection->lock);
+        connection_shutdown(connection);
+        pthread_mutex_unlock(&connection->lock);
     }
 
-    struct message ** list = parent ? &parent->children : &context->messages;
-    struct message * new_message = malloc(sizeof(struct message));
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        --connection->operations;
+
+        if (!connection->closing) {
+            reactor_receive(reactor, connection);
+        }
+    }
 
-    new_message->next = *list;
-    new_message->id = ++context->prev_id;
-    new_message->author = strdup(username);
-    new_message->text = strdup(message);
-    new_message->children = NULL;
-    *list = new_message;
+    reactor_release(reactor, connection);
+}
 
-    size_t username_length = strlen(username), message_length = strlen(message);
-    for (int i = 0; i < context->clients.amount; ++i) {
-        write(context->clients.sockets[i], &new_message->id, sizeof(new_message->id));
-        write(context->clients.sockets[i], &reply_id, sizeof(reply_id));
-        write(context->clients.sockets[i], &username_length, sizeof(username_length));
-        write(context->clients.sockets[i], username, username_length);
-        write(context->clients.sockets[i], &message_length, sizeof(message_length));
-        write(context->clients.sockets[i], message, message_length);
+static void reactor_sent(struct reactor * reactor, struct connection * connection, const struct io_uring_cqe * cqe) {
+    // a zero-copy send completes twice, the second time once the kernel does not read the frames anymore
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        connection->send.result = cqe->res;
+        return;
     }
 
-    if (reply_id) {
-        printf("Message from %s as a reply to %lld: %s\n", username, reply_id, message);
+    int result = cqe->flags & IORING_CQE_F_NOTIF ? connection->send.result : cqe->res;
+
+    --connection->operations;
+
+    pthread_mutex_lock(&connection->lock);
+
+    connection->send.active = false;
+
+    if (result < 0) {
+        connection->output.pinned = 0;
+        connection_shutdown(connection);
     } else {
-        printf("Message from %s: %s\n", username, message);
+        output_queue_consume(&connection->output, (size_t) result);
+        metrics_add(&reactor->context->metrics, METRICS_BYTES_OUT, result);
     }
+
+    pthread_mutex_unlock(&connection->lock);
+
+    // the rest of the queue and the history that is still to be replayed go out with the next batch
+    connection_flush(connection);
+
+    reactor_release(reactor, connection);
 }
 
-// packet: <reply_id or 0><strlen(username)><username><strlen(message)><message>
-static void * listen_to_client(void * param) {
-    struct client_context * context = param;
-
-    while (!context->server_context->closing) {
-        long long reply_id;
-        if (read(context->socket, &reply_id, sizeof(reply_id)) <= 0) {
-            for (int i = 0; i < context->server_context->clients.amount; ++i) {
-                if (context->server_context->clients.sockets[i] == context->socket) {
-                    context->server_context->clients.sockets[i] = context->server_context->clients.sockets[--context->server_context->clients.amount];
-                    break;
-                }
+static void reactor_complete(struct reactor * reactor, const struct io_uring_cqe * cqe) {
+    struct server_context * context = reactor->context;
+    void * pointer = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) 3);
+
+    switch ((enum uring_request) (cqe->user_data & 3)) {
+        case URING_ACCEPT:
+            if (cqe->res >= 0) {
+                struct connection * connection = connection_new(reactor, cqe->res);
+
+                server_context_add_client(context, connection);
+                reactor_receive(reactor, connection);
+            }
+
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                reactor_accept(reactor);
             }
 
-            close(context->socket);
+            break;
+
+        case URING_WAKEUP:
+            reactor_drain_inbox(reactor);
+            reactor_wait_wakeup(reactor);
+            break;
+
+        case URING_RECEIVE:
+            reactor_received(reactor, pointer, cqe);
+            break;
+
+        case URING_SEND:
+            reactor_sent(reactor, pointer, cqe);
+            break;
+    }
+}
+
+// the io_uring event loop of one shard: completions of a wait are handled together,
+// the sends they cause are submitted with the next wait in a single system call
+static void * reactor_run_uring(void * param) {
+    struct reactor * reactor = param;
+    struct server_context * context = reactor->context;
+
+    current_reactor = reactor;
+    reactor_pin(reactor);
+
+    reactor_accept(reactor);
+    reactor_wait_wakeup(reactor);
+
+    while (!context->closing) {
+        size_t enters = reactor->uring.enters;
+
+        reactor_submit_sends(reactor);
+
+        // timeout lets the loop notice the quit command from the console
+        if (!uring_enter(&reactor->uring, 100)) {
+            printf("io_uring of reactor %u failed: %s\n", reactor->index, strerror(errno));
             break;
         }
 
-        size_t username_length, message_length;
-        read(context->socket, &username_length, sizeof(username_length));
+        metrics_add(&context->metrics, METRICS_URING_ENTERS, (int64_t) (reactor->uring.enters - enters));
 
-        char username[username_length + 1];
-        read(context->socket, username, username_length);
-        username[username_length] = '\0';
+        // connections removed while the console was reading the registry
+        registry_collect(&reactor->clients);
 
-        read(context->socket, &message_length, sizeof(message_length));
+        struct io_uring_cqe * entry;
 
-        char message[message_length + 1];
-        read(context->socket, message, message_length);
-        message[message_length] = '\0';
+        while ((entry = uring_peek(&reactor->uring))) {
+            struct io_uring_cqe cqe = *entry;
 
-        server_context_add_message(context->server_context, reply_id, username, message);
+            // handling may submit requests, the completion queue entry is not needed anymore
+            uring_seen(&reactor->uring);
+            reactor_complete(reactor, &cqe);
+        }
     }
 
-    pthread_exit(0);
+    return NULL;
 }
 
-static void server_context_add_client(struct server_context * context, int socket) {
-    if (context->clients.capacity == context->clients.amount) {
-        context->clients.capacity *= 2;
-        context->clients.sockets = realloc(context->clients.sockets, sizeof(int) * context->clients.capacity);
+// a reactor thread per shard, the sequencer hands every batch to all of them
+static void server_run_reactors(struct server_context * context) {
+    void * (* run)(void *) = context->options.mode == SERVER_MODE_URING ? reactor_run_uring : reactor_run;
+
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        pthread_create(&context->reactors[r].thread, NULL, run, &context->reactors[r]);
     }
 
-    context->clients.sockets[context->clients.amount++] = socket;
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        pthread_join(context->reactors[r].thread, NULL);
+    }
 }
 
-static void handle_client_send_messages(int socket, struct message * messages, long long reply_id) {
-    for (struct message * msg = messages; msg; msg = msg->next) {
-        size_t author_length = strlen(msg->author), text_length = strlen(msg->text);
+// the original thread-per-client model, kept for comparison
+static void server_run_threads(struct server_context * context) {
+    struct reactor * reactor = &context->reactors[0];
+
+    while (!context->closing) {
+        int ret = accept4(reactor->listener, NULL, NULL, SOCK_NONBLOCK);
+
+        if (ret >= 0) {
+            handle_client(ret, reactor);
+        }
 
-        write(socket, &msg->id, sizeof(msg->id));
-        write(socket, &reply_id, sizeof(reply_id));
-        write(socket, &author_length, sizeof(author_length));
-        write(socket, msg->author, author_length);
-        write(socket, &text_length, sizeof(text_length));
-        write(socket, msg->text, text_length);
+        // connections removed while other threads were broadcasting
+        registry_collect(&reactor->clients);
 
-        handle_client_send_messages(socket, msg->children, msg->id);
+        sched_yield();
     }
 }
 
-static void handle_client(int socket, struct server_context * server_context) {
-    pthread_t tid; /* идентификатор потока */
-    pthread_attr_t attr; /* атрибуты потока */
+// one JSON object with the counters, the latency histograms and the current sizes of queues and history
+static void server_context_print_stats(struct server_context * context, FILE * file) {
+    int64_t counters[METRICS_COUNTERS];
+    struct histogram histograms[METRICS_HISTOGRAMS];
+    size_t queued_bytes = 0, queued_frames = 0, max_queued_bytes = 0, catching_up = 0;
 
-/* получаем дефолтные значения атрибутов */
-    pthread_attr_init(&attr);
+    metrics_collect(&context->metrics, counters, histograms);
 
-    struct client_context * client_context = malloc(sizeof(struct client_context));
-    client_context->server_context = server_context;
-    client_context->socket = socket;
+    fprintf(file, "{\"uptime\":%.3f", (double) (now_ns() - context->started) / 1e9);
 
-    handle_client_send_messages(socket, server_context->messages, 0);
+    size_t count = 0;
 
-    server_context_add_client(server_context, socket);
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        struct reactor * reactor = &context->reactors[r];
+        const struct registry_snapshot * clients = registry_read_begin(&reactor->clients);
 
-/* создаем новый поток */
-    pthread_create(&tid, &attr, listen_to_client, client_context);
+        for (size_t i = 0; i < clients->count; ++i) {
+            struct connection * connection = clients->items[i];
+
+            pthread_mutex_lock(&connection->lock);
+
+            queued_bytes += connection->output.bytes;
+            queued_frames += connection->output.count;
+            max_queued_bytes = connection->output.bytes > max_queued_bytes ? connection->output.bytes : max_queued_bytes;
+            catching_up += connection->replay.active && connection->greeted;
+
+            pthread_mutex_unlock(&connection->lock);
+        }
+
+        count += clients->count;
+        registry_read_end(&reactor->clients);
+    }
+
+    fprintf(file, ",\"reactors\":%u,\"clients\":%zu,\"queued_bytes\":%zu,\"queued_frames\":%zu,\"max_queued_bytes\":%zu,\"catching_up\":%zu",
+            context->reactor_count, count, queued_bytes, queued_frames, max_queued_bytes, catching_up);
+
+    pthread_mutex_lock(&context->lock);
+    fprintf(file, ",\"messages\":%lld,\"history_bytes\":%zu,\"arena_bytes\":%zu",
+            context->prev_id, context->snapshot.bytes, context->store.arena.stats.used);
+    pthread_mutex_unlock(&context->lock);
+
+    pthread_mutex_lock(&context->authors_lock);
+    fprintf(file, ",\"authors\":%zu", context->authors.count);
+    pthread_mutex_unlock(&context->authors_lock);
+
+    for (int i = 0; i < METRICS_COUNTERS; ++i) {
+        fprintf(file, ",\"%s\":%lld", metrics_counter_name(i), (long long) counters[i]);
+    }
+
+    for (int i = 0; i < METRICS_HISTOGRAMS; ++i) {
+        fprintf(file, ",");
+        histogram_print_json(file, metrics_histogram_name(i), &histograms[i], metrics_histogram_unit(i));
+    }
+
+    fprintf(file, "}\n");
+}
+
+// every connection to the stats socket gets the stats and is closed
+static void * handle_stats(void * param) {
+    struct server_context * context = param;
+    int stats_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, context->options.stats_path, sizeof(address.sun_path) - 1);
+
+    unlink(context->options.stats_path);
+
+    if (bind(stats_socket, (struct sockaddr *) &address, sizeof(address)) || listen(stats_socket, 16)) {
+        printf("Cannot listen on the stats socket %s\n", context->options.stats_path);
+        close(stats_socket);
+        pthread_exit(0);
+    }
+
+    while (!context->closing) {
+        struct pollfd pollfd = {.fd = stats_socket, .events = POLLIN};
+
+        // the timeout lets the thread notice the quit command
+        if (poll(&pollfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        int client = accept(stats_socket, NULL, NULL);
+
+        if (client < 0) {
+            continue;
+        }
+
+        char * stats;
+        size_t length;
+        FILE * file = open_memstream(&stats, &length);
+
+        server_context_print_stats(context, file);
+        fclose(file);
+
+        for (size_t sent = 0; sent < length;) {
+            ssize_t ret = write(client, stats + sent, length - sent);
+
+            if (ret <= 0) {
+                break;
+            }
+
+            sent += (size_t) ret;
+        }
+
+        free(stats);
+        close(client);
+    }
+
+    close(stats_socket);
+    unlink(context->options.stats_path);
+
+    pthread_exit(0);
 }
 
 static void * handle_console(void * param) {
@@ -176,7 +2252,54 @@ static void * handle_console(void * param) {
 
         switch (c) {
             case 'h':
-                printf("Available commands: h - help, q - quit\n");
+                printf("Available commands: h - help, c - clients, m - memory usage, s - stats, q - quit\n");
+                break;
+
+            case 's':
+                server_context_print_stats(context, stdout);
+                break;
+
+            case 'c':
+                for (unsigned r = 0; r < context->reactor_count; ++r) {
+                    struct reactor * reactor = &context->reactors[r];
+                    const struct registry_snapshot * clients = registry_read_begin(&reactor->clients);
+                    printf("Reactor %u clients: %zu\n", r, clients->count);
+
+                    for (size_t i = 0; i < clients->count; ++i) {
+                        struct connection * connection = clients->items[i];
+
+                        pthread_mutex_lock(&connection->lock);
+                        printf("  socket %d: %zu bytes in %zu queued frames, %zu dropped frames%s\n",
+                               connection->socket, connection->output.bytes, connection->output.count,
+                               connection->dropped_frames, connection->replay.active ? ", catching up" : "");
+                        pthread_mutex_unlock(&connection->lock);
+                    }
+
+                    registry_read_end(&reactor->clients);
+                }
+
+                break;
+
+            case 'm':
+                pthread_mutex_lock(&context->lock);
+                printf("Messages: %lld, arena: %zu chunks, %zu allocations, %zu bytes used of %zu reserved\n",
+                       context->prev_id, context->store.arena.stats.chunks, context->store.arena.stats.allocations,
+                       context->store.arena.stats.used, context->store.arena.stats.reserved);
+
+                printf("Snapshot: generation %lld, %zu bytes in %zu chunks\n", context->snapshot.generation,
+                       context->snapshot.bytes, context->snapshot.count);
+
+                if (context->journal) {
+                    printf("Log: %zu records, %zu bytes, %zu syncs\n", context->journal->stats.records,
+                           context->journal->stats.bytes, context->journal->stats.syncs);
+                }
+
+                pthread_mutex_unlock(&context->lock);
+
+                pthread_mutex_lock(&context->authors_lock);
+                printf("Authors: %zu, %zu bytes\n", context->authors.count, context->authors.arena.stats.used);
+                pthread_mutex_unlock(&context->authors_lock);
+                break;
 
             case 'q':
                 context->closing = true;
@@ -193,43 +2316,221 @@ static void * handle_console(void * param) {
 }
 
 static void run_console_handler(struct server_context * context) {
-    pthread_t tid; /* идентификатор потока */
-    pthread_attr_t attr; /* атрибуты потока */
+/* создаем новый поток */
+    pthread_create(&context->console, NULL, handle_console, context);
 
-/* получаем дефолтные значения атрибутов */
-    pthread_attr_init(&attr);
+    if (context->options.stats_path) {
+        pthread_create(&context->stats, NULL, handle_stats, context);
+    }
+}
 
-/* создаем новый поток */
-    pthread_create(&tid, &attr, handle_console, context);
+static bool server_parse_options(int argc, char * argv[], struct server_options * options) {
+    int option;
+
+    options->mode = SERVER_MODE_EPOLL;
+    options->high_water_mark = DEFAULT_HIGH_WATER_MARK;
+    options->policy = SLOW_CONSUMER_COALESCE;
+    options->log_path = NULL;
+    options->durability_interval = DEFAULT_DURABILITY_INTERVAL;
+    options->reactors = DEFAULT_REACTORS;
+    options->stats_path = NULL;
+    options->log_rate = 0;
+
+    while ((option = getopt(argc, argv, "m:q:p:l:d:r:S:L:")) != -1) {
+        switch (option) {
+            case 'm':
+                if (strcmp(optarg, "epoll") == 0) {
+                    options->mode = SERVER_MODE_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    options->mode = SERVER_MODE_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    options->mode = SERVER_MODE_THREADS;
+                } else {
+                    printf("Unknown server mode: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+
+            case 'q':
+            {
+                char * end;
+                options->high_water_mark = strtoul(optarg, &end, 10);
+
+                if (*end != '\0' || options->high_water_mark == 0) {
+                    printf("Bad high-water mark: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+            }
+
+            case 'p':
+                if (strcmp(optarg, "drop") == 0) {
+                    options->policy = SLOW_CONSUMER_DROP_OLDEST;
+                } else if (strcmp(optarg, "coalesce") == 0) {
+                    options->policy = SLOW_CONSUMER_COALESCE;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    options->policy = SLOW_CONSUMER_DISCONNECT;
+                } else {
+                    printf("Unknown slow consumer policy: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+
+            case 'l':
+                options->log_path = optarg;
+                break;
+
+            case 'd':
+            {
+                char * end;
+                options->durability_interval = strtoul(optarg, &end, 10);
+
+                if (*end != '\0') {
+                    printf("Bad durability interval: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+            }
+
+            case 'r':
+            {
+                char * end;
+                options->reactors = strtoul(optarg, &end, 10);
+
+                if (*end != '\0') {
+                    printf("Bad reactor count: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+            }
+
+            case 'S':
+                options->stats_path = optarg;
+                break;
+
+            case 'L':
+            {
+                char * end;
+                options->log_rate = strtoul(optarg, &end, 10);
+
+                if (*end != '\0') {
+                    printf("Bad log rate: %s\n", optarg);
+                    return false;
+                }
+
+                break;
+            }
+
+            default:
+                return false;
+        }
+    }
+
+    return true;
 }
 
-int server_main() {
-    // create the server socket
-    int server_socket;
-    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+int server_main(int argc, char * argv[]) {
+    struct server_options options;
 
-    // define the server address
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(9002);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+    if (!server_parse_options(argc, argv, &options)) {
+        printf("Usage: s [-m epoll|uring|threads] [-q high-water mark in bytes] [-p drop|coalesce|disconnect]"
+               " [-l log file] [-d durability interval in ms, 0 - sync every batch] [-r epoll reactors, 0 - one per core]"
+               " [-S stats socket] [-L logged messages per second, 0 - none]\n");
+        return 1;
+    }
 
-    // bind the socket to our specified IP and port
-    bind(server_socket, (struct sockaddr*) &server_address, sizeof(server_address));
+    if (options.mode == SERVER_MODE_URING && !uring_supported()) {
+        printf("io_uring is not supported by the kernel, falling back to epoll\n");
+        options.mode = SERVER_MODE_EPOLL;
+    }
 
-    // second argument is a backlog - how many connections can be waiting for this socket simultaneously
-    listen(server_socket, 255);
+    if (options.mode == SERVER_MODE_THREADS) {
+        options.reactors = 1;
+    } else if (options.reactors == 0) {
+        cpu_set_t allowed;
+        unsigned cores = server_cores(&allowed);
+
+        options.reactors = cores > 0 ? cores : 1;
+    }
 
-    struct server_context * context = malloc(sizeof(struct server_context));
-    context->clients.amount = 0;
-    context->clients.capacity = 2;
-    context->clients.sockets = malloc(sizeof(int) * 2);
+    // the rings keep their producer and consumer ends on separate cache lines
+    struct server_context * context = aligned_alloc(alignof(struct server_context), sizeof(struct server_context));
+    context->options = options;
     context->prev_id = 0;
-    context->messages = NULL;
+    message_store_init(&context->store);
+    context->roots.slots = NULL;
+    context->roots.replies = NULL;
+    context->roots.count = 0;
+    context->roots.capacity = 0;
+    pthread_mutex_init(&context->lock, NULL);
+    author_table_init(&context->authors);
+    pthread_mutex_init(&context->authors_lock, NULL);
+    context->journal = NULL;
+    snapshot_init(&context->snapshot);
+    snapshot_init(&context->root_snapshot);
+    metrics_init(&context->metrics);
+    context->started = now_ns();
+    pthread_mutex_init(&context->log.lock, NULL);
+    context->log.second = 0;
+    context->log.count = 0;
     context->closing = false;
+    ring_init(&context->ingest.ring, INGEST_RING_CAPACITY, sizeof(struct post));
+    pthread_mutex_init(&context->ingest.lock, NULL);
+    pthread_cond_init(&context->ingest.cond, NULL);
+    context->ingest.sleeping = false;
+
+    // the listeners are bound before the recovery, like the single one was
+    context->reactor_count = options.reactors;
+    context->reactors = aligned_alloc(alignof(struct reactor), sizeof(struct reactor) * context->reactor_count);
+
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        if (!reactor_init(&context->reactors[r], context, r)) {
+            printf("Cannot set up io_uring for reactor %u\n", r);
+            return 1;
+        }
+    }
+
+    if (options.log_path) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        context->journal = malloc(sizeof(struct journal));
+
+        if (!journal_open(context->journal, options.log_path, options.durability_interval, server_context_restore_message, context)) {
+            printf("Cannot open the message log %s\n", options.log_path);
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        printf("Recovered %zu messages from %s in %.1f ms", context->journal->stats.records, options.log_path,
+               (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6);
+
+        if (context->journal->stats.truncated_bytes) {
+            printf(", %zu bytes of a torn tail truncated", context->journal->stats.truncated_bytes);
+        }
+
+        printf("\n");
+
+        context->history_id = context->journal->history_id;
+    } else {
+        context->history_id = 0;
+
+        while (context->history_id == 0) {
+            getrandom(&context->history_id, sizeof(context->history_id), 0);
+        }
+    }
 
     struct termios stored_settings = set_keypress();
 
+    // the sequencer starts after the recovery, so the ids it gives continue the log
+    pthread_create(&context->ingest.sequencer, NULL, server_sequencer, context);
+
     run_console_handler(context);
 
     {
@@ -241,23 +2542,59 @@ int server_main() {
         sigaction(SIGPIPE, &sa, NULL);
     }
 
-    while (!context->closing) {
-        int ret = accept(server_socket, NULL, NULL);
+    switch (options.mode) {
+        case SERVER_MODE_EPOLL:
+        case SERVER_MODE_URING:
+            server_run_reactors(context);
+            break;
 
-        if (ret >= 0) {
-            handle_client(ret, context);
-        }
+        case SERVER_MODE_THREADS:
+            server_run_threads(context);
+            break;
+    }
 
-        sched_yield();
+    // the sequencer broadcasts the posts that are still in the ring and exits
+    pthread_join(context->ingest.sequencer, NULL);
+    pthread_join(context->console, NULL);
+
+    if (context->options.stats_path) {
+        pthread_join(context->stats, NULL);
     }
 
-    for (int i = 0; i < context->clients.amount; ++i) {
-        close(context->clients.sockets[i]);
+    for (unsigned r = 0; r < context->reactor_count; ++r) {
+        reactor_free(&context->reactors[r]);
     }
 
-    close(server_socket);
+    free(context->reactors);
+
     reset_keypress(stored_settings);
 
+    if (context->journal) {
+        journal_close(context->journal);
+        free(context->journal);
+    }
+
+    snapshot_free(&context->snapshot);
+    snapshot_free(&context->root_snapshot);
+    metrics_free(&context->metrics);
+    ring_free(&context->ingest.ring);
+    message_store_free(&context->store);
+
+    for (size_t i = 0; i < context->roots.count; ++i) {
+        free(context->roots.replies[i].slots);
+    }
+
+    free(context->roots.slots);
+    free(context->roots.replies);
+    author_table_free(&context->authors);
+
+    pthread_mutex_destroy(&context->lock);
+    pthread_mutex_destroy(&context->authors_lock);
+    pthread_mutex_destroy(&context->log.lock);
+    pthread_mutex_destroy(&context->ingest.lock);
+    pthread_cond_destroy(&context->ingest.cond);
+    free(context);
+
     printf("Bye!\n");
     return 0;
 }
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+
+#include "snapshot.h"
+#include "protocol.h"
+
+void snapshot_init(struct snapshot * snapshot) {
+    snapshot->capacity = 0;
+    snapshot->count = 0;
+    snapshot->chunks = NULL;
+    snapshot->generation = 0;
+    snapshot->bytes = 0;
+    snapshot->positions = NULL;
+    snapshot->positions_capacity = 0;
+}
+
+static struct snapshot_chunk * snapshot_new_chunk(struct snapshot * snapshot, long long first_id, size_t size) {
+    if (snapshot->count == snapshot->capacity) {
+        snapshot->capacity = snapshot->capacity ? snapshot->capacity * 2 : 64;
+        snapshot->chunks = realloc(snapshot->chunks, sizeof(struct snapshot_chunk) * snapshot->capacity);
+    }
+
+    struct snapshot_chunk * chunk = &snapshot->chunks[snapshot->count++];
+
+    chunk->frame = frame_new(size);
+    chunk->first_id = first_id;
+    chunk->length = 0;
+
+    return chunk;
+}
+
+struct frame_slice snapshot_append(struct snapshot * snapshot, long long id, long long reply_id, uint32_t author,
+                                   const char * text, size_t text_length) {
+    size_t length = protocol_message_length(id, reply_id, author, text_length);
+    struct snapshot_chunk * chunk = snapshot->count ? &snapshot->chunks[snapshot->count - 1] : NULL;
+
+    if (!chunk || chunk->frame->length - chunk->length < length) {
+        // a big message gets a chunk of its own
+        chunk = snapshot_new_chunk(snapshot, id, length > SNAPSHOT_CHUNK_SIZE ? length : SNAPSHOT_CHUNK_SIZE);
+    }
+
+    struct frame_slice slice = {
+        .frame = frame_ref(chunk->frame),
+        .offset = chunk->length,
+        .length = length,
+    };
+
+    size_t first = snapshot->generation ? (size_t) (snapshot->generation + 1 - snapshot->chunks[0].first_id) : 0;
+    size_t index = (size_t) (id - snapshot->chunks[0].first_id);
+
+    while (index >= snapshot->positions_capacity) {
+        snapshot->positions_capacity = snapshot->positions_capacity ? snapshot->positions_capacity * 2 : 1024;
+        snapshot->positions = realloc(snapshot->positions, sizeof(struct snapshot_position) * snapshot->positions_capacity);
+    }
+
+    // ids skipped since the previous message start where this one does
+    for (size_t i = first; i <= index; ++i) {
+        snapshot->positions[i].chunk = (uint32_t) (chunk - snapshot->chunks);
+        snapshot->positions[i].offset = (uint32_t) chunk->length;
+    }
+
+    protocol_encode_message(chunk->frame->data + chunk->length, id, reply_id, author, text, text_length);
+
+    chunk->length += length;
+    snapshot->generation = id;
+    snapshot->bytes += length;
+
+    return slice;
+}
+
+long long snapshot_queue(const struct snapshot * snapshot, long long id, long long end, struct output_queue * queue,
+                         size_t limit) {
+    if (end > snapshot->generation + 1) {
+        end = snapshot->generation + 1;
+    }
+
+    if (id >= end || snapshot->count == 0) {
+        return id;
+    }
+
+    if (id < snapshot->chunks[0].first_id) {
+        id = snapshot->chunks[0].first_id;
+    }
+
+    const struct snapshot_position * position = &snapshot->positions[id - snapshot->chunks[0].first_id];
+    size_t low = position->chunk, offset = position->offset;
+
+    // the message at end is the first one left out, past the last message the rest of the last chunk goes
+    struct snapshot_position last = {(uint32_t) (snapshot->count - 1), (uint32_t) snapshot->chunks[snapshot->count - 1].length};
+
+    if (end <= snapshot->generation) {
+        last = snapshot->positions[end - snapshot->chunks[0].first_id];
+    }
+
+    for (size_t i = low; i <= last.chunk; ++i) {
+        const struct snapshot_chunk * chunk = &snapshot->chunks[i];
+        size_t length = (i == last.chunk ? last.offset : chunk->length) - offset;
+
+        if (length > 0) {
+            struct frame_slice slice = {
+                .frame = frame_ref(chunk->frame),
+                .offset = offset,
+                .length = length,
+            };
+
+            output_queue_push_slice(queue, slice);
+        }
+
+        offset = 0;
+
+        if (queue->bytes >= limit && i < last.chunk) {
+            return snapshot->chunks[i + 1].first_id;
+        }
+    }
+
+    return end;
+}
+
+struct frame_slice snapshot_message(const struct snapshot * snapshot, long long id) {
+    struct frame_slice slice = {NULL, 0, 0};
+
+    if (snapshot->count == 0 || id < snapshot->chunks[0].first_id || id > snapshot->generation) {
+        return slice;
+    }
+
+    const struct snapshot_position * position = &snapshot->positions[id - snapshot->chunks[0].first_id];
+    const struct snapshot_chunk * chunk = &snapshot->chunks[position->chunk];
+
+    slice.frame = chunk->frame;
+    slice.offset = position->offset;
+    slice.length = protocol_frame_length(chunk->frame->data + position->offset);
+
+    return slice;
+}
+
+void snapshot_free(struct snapshot * snapshot) {
+    for (size_t i = 0; i < snapshot->count; ++i) {
+        frame_unref(snapshot->chunks[i].frame);
+    }
+
+    free(snapshot->chunks);
+    free(snapshot->positions);
+    snapshot_init(snapshot);
+}
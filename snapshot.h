@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+
+#define SNAPSHOT_CHUNK_SIZE (64 * 1024)
+
+struct snapshot_chunk {
+    struct frame * frame;
+    long long first_id;
+    size_t length; // bytes used, messages first_id, first_id + 1, ... follow each other
+};
+
+// where a message starts
+struct snapshot_position {
+    uint32_t chunk;
+    uint32_t offset;
+};
+
+/*
+ * The history encoded as message frames, appended as messages arrive.
+ * Chunks are shared by reference, so broadcasts and replays queue slices of them without copying.
+ * The generation is the id of the last appended message: a slice taken at generation G
+ * never changes, later messages only go after it.
+ */
+struct snapshot {
+    size_t capacity;
+    size_t count;
+    struct snapshot_chunk * chunks;
+
+    long long generation;
+    size_t bytes;
+
+    // indexed by the id minus the id of the first message, an id without a message points at the next message
+    struct snapshot_position * positions;
+    size_t positions_capacity;
+};
+
+void snapshot_init(struct snapshot * snapshot);
+// ids have to be appended in ascending order, returns a referenced slice holding the encoded message
+struct frame_slice snapshot_append(struct snapshot * snapshot, long long id, long long reply_id, uint32_t author,
+                                   const char * text, size_t text_length);
+// queues messages with ids in [id, end) until the queue holds at least limit bytes, returns the id of the first message
+// not queued
+long long snapshot_queue(const struct snapshot * snapshot, long long id, long long end, struct output_queue * queue,
+                         size_t limit);
+// the encoded message without a reference of its own, the next one for an id without a message,
+// the frame is NULL past the last message
+struct frame_slice snapshot_message(const struct snapshot * snapshot, long long id);
+void snapshot_free(struct snapshot * snapshot);
@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "subscriptions.h"
+
+static size_t subscriptions_hash(long long root_id, size_t capacity) {
+    return (size_t) ((unsigned long long) root_id * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+}
+
+void subscriptions_init(struct subscriptions * subscriptions) {
+    subscriptions->count = 0;
+    subscriptions->capacity = 0;
+    subscriptions->entries = NULL;
+}
+
+// the entry of the thread or the free one it would take
+static struct subscription * subscriptions_lookup(const struct subscriptions * subscriptions, long long root_id) {
+    size_t mask = subscriptions->capacity - 1;
+    size_t i = subscriptions_hash(root_id, subscriptions->capacity);
+
+    while (subscriptions->entries[i].root_id != 0 && subscriptions->entries[i].root_id != root_id) {
+        i = (i + 1) & mask;
+    }
+
+    return &subscriptions->entries[i];
+}
+
+static void subscriptions_grow(struct subscriptions * subscriptions) {
+    struct subscription * entries = subscriptions->entries;
+    size_t capacity = subscriptions->capacity;
+
+    subscriptions->capacity = capacity ? capacity * 2 : 64;
+    subscriptions->entries = calloc(subscriptions->capacity, sizeof(struct subscription));
+
+    for (size_t i = 0; i < capacity; ++i) {
+        if (entries[i].root_id != 0) {
+            *subscriptions_lookup(subscriptions, entries[i].root_id) = entries[i];
+        }
+    }
+
+    free(entries);
+}
+
+bool subscriptions_add(struct subscriptions * subscriptions, long long root_id, void * subscriber) {
+    // at most three quarters of the entries are taken
+    if ((subscriptions->count + 1) * 4 > subscriptions->capacity * 3) {
+        subscriptions_grow(subscriptions);
+    }
+
+    struct subscription * entry = subscriptions_lookup(subscriptions, root_id);
+
+    if (entry->root_id == 0) {
+        entry->root_id = root_id;
+        ++subscriptions->count;
+    }
+
+    for (size_t i = 0; i < entry->count; ++i) {
+        if (entry->subscribers[i] == subscriber) {
+            return false;
+        }
+    }
+
+    if (entry->count == entry->capacity) {
+        entry->capacity = entry->capacity ? entry->capacity * 2 : 4;
+        entry->subscribers = realloc(entry->subscribers, sizeof(void *) * entry->capacity);
+    }
+
+    entry->subscribers[entry->count++] = subscriber;
+    return true;
+}
+
+// frees the entry and moves back the following ones that would not be found past the hole
+static void subscriptions_delete(struct subscriptions * subscriptions, struct subscription * entry) {
+    size_t mask = subscriptions->capacity - 1;
+    size_t hole = (size_t) (entry - subscriptions->entries);
+
+    free(entry->subscribers);
+
+    for (size_t i = (hole + 1) & mask; subscriptions->entries[i].root_id != 0; i = (i + 1) & mask) {
+        size_t home = subscriptions_hash(subscriptions->entries[i].root_id, subscriptions->capacity);
+
+        // the entry stays if its home lies cyclically in (hole, i]
+        if (((i - home) & mask) < ((i - hole) & mask)) {
+            continue;
+        }
+
+        subscriptions->entries[hole] = subscriptions->entries[i];
+        hole = i;
+    }
+
+    memset(&subscriptions->entries[hole], 0, sizeof(struct subscription));
+    --subscriptions->count;
+}
+
+bool subscriptions_remove(struct subscriptions * subscriptions, long long root_id, void * subscriber) {
+    if (subscriptions->count == 0) {
+        return false;
+    }
+
+    struct subscription * entry = subscriptions_lookup(subscriptions, root_id);
+
+    for (size_t i = 0; i < entry->count; ++i) {
+        if (entry->subscribers[i] == subscriber) {
+            entry->subscribers[i] = entry->subscribers[--entry->count];
+
+            if (entry->count == 0) {
+                subscriptions_delete(subscriptions, entry);
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const struct subscription * subscriptions_find(const struct subscriptions * subscriptions, long long root_id) {
+    if (subscriptions->count == 0) {
+        return NULL;
+    }
+
+    struct subscription * entry = subscriptions_lookup(subscriptions, root_id);
+
+    return entry->root_id == 0 ? NULL : entry;
+}
+
+void subscriptions_free(struct subscriptions * subscriptions) {
+    for (size_t i = 0; i < subscriptions->capacity; ++i) {
+        free(subscriptions->entries[i].subscribers);
+    }
+
+    free(subscriptions->entries);
+    subscriptions_init(subscriptions);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the subscribers of one thread in no particular order
+struct subscription {
+    long long root_id; // 0 if the entry is free
+    size_t count;
+    size_t capacity;
+    void ** subscribers;
+};
+
+/*
+ * Thread root id -> subscribers, open addressing with linear probing.
+ * Entries of threads without subscribers are removed by shifting the following ones back,
+ * so lookups never walk over deleted entries. Not synchronized, the owner locks it.
+ */
+struct subscriptions {
+    size_t count;
+    size_t capacity; // a power of two
+    struct subscription * entries;
+};
+
+void subscriptions_init(struct subscriptions * subscriptions);
+// returns false if the subscriber has already been there
+bool subscriptions_add(struct subscriptions * subscriptions, long long root_id, void * subscriber);
+// returns false if there has been no such subscriber
+bool subscriptions_remove(struct subscriptions * subscriptions, long long root_id, void * subscriber);
+// NULL if the thread has no subscribers, valid until the next change
+const struct subscription * subscriptions_find(const struct subscriptions * subscriptions, long long root_id);
+void subscriptions_free(struct subscriptions * subscriptions);
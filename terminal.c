@@ -1,5 +1,13 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
 #include "terminal.h"
 
+#define CSI "\x1B["
+
 struct termios set_keypress() {
     struct termios stored_settings, new_settings;
 
@@ -18,3 +26,99 @@ struct termios set_keypress() {
 void reset_keypress(struct termios stored_settings) {
     tcsetattr(0, TCSANOW, &stored_settings);
 }
+
+void screen_init(struct screen * screen, size_t width, size_t height) {
+    screen->width = width;
+    screen->height = height;
+    screen->shown = malloc(width * height);
+    screen->next = malloc(width * height);
+    screen->valid = false;
+
+    memset(screen->next, ' ', width * height);
+
+    screen->output.capacity = 4096;
+    screen->output.length = 0;
+    screen->output.buffer = malloc(screen->output.capacity);
+}
+
+char * screen_row(struct screen * screen, size_t row) {
+    char * line = screen->next + row * screen->width;
+
+    memset(line, ' ', screen->width);
+
+    return line;
+}
+
+static void screen_put(struct screen * screen, const char * data, size_t length) {
+    if (screen->output.length + length > screen->output.capacity) {
+        while (screen->output.length + length > screen->output.capacity) {
+            screen->output.capacity *= 2;
+        }
+
+        screen->output.buffer = realloc(screen->output.buffer, screen->output.capacity);
+    }
+
+    memcpy(screen->output.buffer + screen->output.length, data, length);
+    screen->output.length += length;
+}
+
+static void screen_move(struct screen * screen, size_t row, size_t column) {
+    char sequence[48];
+    int length = snprintf(sequence, sizeof(sequence), CSI"%zu;%zuH", row + 1, column + 1);
+
+    screen_put(screen, sequence, (size_t) length);
+}
+
+void screen_flush(struct screen * screen, size_t cursor_row, size_t cursor_column) {
+    screen->output.length = 0;
+
+    if (!screen->valid) {
+        screen_put(screen, CSI"2J", sizeof(CSI"2J") - 1);
+        memset(screen->shown, ' ', screen->width * screen->height);
+        screen->valid = true;
+    }
+
+    for (size_t row = 0; row < screen->height; ++row) {
+        char * shown = screen->shown + row * screen->width;
+        const char * next = screen->next + row * screen->width;
+        size_t first = 0, last = screen->width;
+
+        while (first < last && shown[first] == next[first]) {
+            ++first;
+        }
+
+        if (first == last) {
+            continue;
+        }
+
+        while (shown[last - 1] == next[last - 1]) {
+            --last;
+        }
+
+        screen_move(screen, row, first);
+        screen_put(screen, next + first, last - first);
+        memcpy(shown + first, next + first, last - first);
+    }
+
+    screen_move(screen, cursor_row, cursor_column);
+
+    for (size_t offset = 0; offset < screen->output.length; ) {
+        ssize_t ret = write(STDOUT_FILENO, screen->output.buffer + offset, screen->output.length - offset);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            break;
+        }
+
+        offset += ret;
+    }
+}
+
+void screen_free(struct screen * screen) {
+    free(screen->shown);
+    free(screen->next);
+    free(screen->output.buffer);
+}
@@ -1,6 +1,34 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <termios.h>
 
 struct termios set_keypress(void);
 void reset_keypress(struct termios stored_settings);
+
+/*
+ * The frame shown on the terminal and the one being composed. Rows of the next frame
+ * keep their content until they are redrawn, so a caller may update a single row.
+ * Flushing writes only the changed span of every changed row.
+ */
+struct screen {
+    size_t width;
+    size_t height;
+    char * shown;
+    char * next;
+    bool valid; // false until the terminal is cleared for the first frame
+
+    struct {
+        size_t capacity;
+        size_t length;
+        char * buffer;
+    } output;
+};
+
+void screen_init(struct screen * screen, size_t width, size_t height);
+// a row of the next frame, width characters filled with spaces
+char * screen_row(struct screen * screen, size_t row);
+// emits the difference with one write and leaves the cursor at the given zero based position
+void screen_flush(struct screen * screen, size_t cursor_row, size_t cursor_column);
+void screen_free(struct screen * screen);
@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define URING_PAGE_SIZE 4096
+
+#define LOAD_ACQUIRE(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(pointer, value) __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+
+static int uring_setup(unsigned entries, struct io_uring_params * params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_register(int fd, unsigned opcode, void * arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+bool uring_init(struct uring * uring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // multishot receives of many connections complete much more often than entries are submitted
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    uring->fd = uring_setup(entries, &params);
+
+    if (uring->fd < 0) {
+        return false;
+    }
+
+    uring->features = params.features;
+    uring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // both rings live in one mapping on every kernel that has the features used here
+    if (uring->features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cq_map_size > uring->sq_map_size) {
+            uring->sq_map_size = uring->cq_map_size;
+        }
+
+        uring->cq_map_size = uring->sq_map_size;
+    }
+
+    uring->sq_map = mmap(NULL, uring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->cq_map = uring->features & IORING_FEAT_SINGLE_MMAP ? uring->sq_map :
+                    mmap(NULL, uring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+
+    if (uring->sq_map == MAP_FAILED || uring->cq_map == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        close(uring->fd);
+        return false;
+    }
+
+    char * sq = uring->sq_map;
+    char * cq = uring->cq_map;
+
+    uring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+    uring->sq_entries = params.sq_entries;
+    uring->tail = *uring->sq_tail;
+
+    uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // entries are always used in ring order, so the indirection array never changes
+    for (unsigned i = 0; i < uring->sq_entries; ++i) {
+        uring->sq_array[i] = i;
+    }
+
+    uring->enters = 0;
+
+    return true;
+}
+
+// hands the entries filled so far to the kernel, optionally waiting for completions
+static int uring_submit(struct uring * uring, unsigned wait, unsigned flags, void * arg, size_t arg_size) {
+    STORE_RELEASE(uring->sq_tail, uring->tail);
+
+    // entries the kernel has not taken yet because of an error are submitted again the next time
+    unsigned pending = uring->tail - LOAD_ACQUIRE(uring->sq_head);
+
+    ++uring->enters;
+    return (int) syscall(__NR_io_uring_enter, uring->fd, pending, wait, flags, arg, arg_size);
+}
+
+struct io_uring_sqe * uring_get_sqe(struct uring * uring) {
+    while (uring->tail - LOAD_ACQUIRE(uring->sq_head) == uring->sq_entries) {
+        uring_submit(uring, 0, 0, NULL, 0);
+    }
+
+    struct io_uring_sqe * sqe = &uring->sqes[uring->tail & uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ++uring->tail;
+    return sqe;
+}
+
+bool uring_enter(struct uring * uring, int timeout_ms) {
+    struct __kernel_timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (long long) (timeout_ms % 1000) * 1000000,
+    };
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t) (uintptr_t) &timeout;
+
+    // completions that are already there are not waited for
+    bool wait = uring_peek(uring) == NULL;
+    int ret = uring_submit(uring, wait, IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg));
+
+    return ret >= 0 || errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY;
+}
+
+struct io_uring_cqe * uring_peek(struct uring * uring) {
+    unsigned head = *uring->cq_head;
+
+    if (head == LOAD_ACQUIRE(uring->cq_tail)) {
+        return NULL;
+    }
+
+    return &uring->cqes[head & uring->cq_mask];
+}
+
+void uring_seen(struct uring * uring) {
+    STORE_RELEASE(uring->cq_head, *uring->cq_head + 1);
+}
+
+void uring_free(struct uring * uring) {
+    munmap(uring->sqes, uring->sqes_size);
+
+    if (uring->cq_map != uring->sq_map) {
+        munmap(uring->cq_map, uring->cq_map_size);
+    }
+
+    munmap(uring->sq_map, uring->sq_map_size);
+    close(uring->fd);
+}
+
+bool uring_buffers_init(struct uring_buffers * buffers, struct uring * uring, uint16_t group, unsigned count, size_t size) {
+    size_t ring_size = (count * sizeof(struct io_uring_buf) + URING_PAGE_SIZE - 1) & ~(size_t) (URING_PAGE_SIZE - 1);
+
+    buffers->ring = aligned_alloc(URING_PAGE_SIZE, ring_size);
+    memset(buffers->ring, 0, ring_size);
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) buffers->ring;
+    registration.ring_entries = count;
+    registration.bgid = group;
+
+    if (uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &registration, 1)) {
+        free(buffers->ring);
+        return false;
+    }
+
+    buffers->memory = malloc(count * size);
+    buffers->count = count;
+    buffers->size = size;
+    buffers->group = group;
+
+    for (unsigned id = 0; id < count; ++id) {
+        uring_buffers_recycle(buffers, id);
+    }
+
+    return true;
+}
+
+char * uring_buffer(struct uring_buffers * buffers, unsigned id) {
+    return buffers->memory + (size_t) id * buffers->size;
+}
+
+void uring_buffers_recycle(struct uring_buffers * buffers, unsigned id) {
+    uint16_t tail = buffers->ring->tail;
+    struct io_uring_buf * buffer = &buffers->ring->bufs[tail & (buffers->count - 1)];
+
+    // the tail shares its place with the reserved field of the first entry, which is not written here
+    buffer->addr = (uint64_t) (uintptr_t) uring_buffer(buffers, id);
+    buffer->len = (uint32_t) buffers->size;
+    buffer->bid = (uint16_t) id;
+
+    STORE_RELEASE(&buffers->ring->tail, (uint16_t) (tail + 1));
+}
+
+void uring_buffers_free(struct uring_buffers * buffers, struct uring * uring) {
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.bgid = buffers->group;
+
+    uring_register(uring->fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+
+    free(buffers->memory);
+    free(buffers->ring);
+}
+
+bool uring_supported(void) {
+    struct uring uring;
+
+    if (!uring_init(&uring, 8)) {
+        return false;
+    }
+
+    bool supported = (uring.features & IORING_FEAT_EXT_ARG) != 0;
+
+    size_t probe_size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = calloc(1, probe_size);
+
+    if (uring_register(uring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)) {
+        supported = false;
+    } else {
+        // zero-copy sendmsg came after multishot accept and receive, so it stands for them too
+        const unsigned operations[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_SENDMSG, IORING_OP_SENDMSG_ZC};
+
+        for (size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); ++i) {
+            if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = false;
+            }
+        }
+    }
+
+    free(probe);
+
+    struct uring_buffers buffers;
+
+    if (supported && uring_buffers_init(&buffers, &uring, 0, 2, 64)) {
+        uring_buffers_free(&buffers, &uring);
+    } else {
+        supported = false;
+    }
+
+    uring_free(&uring);
+    return supported;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring over the raw system calls, so the build does not depend on liburing.
+ * A ring belongs to one thread: it fills submission entries, enters the kernel once for all of them
+ * and reaps the completions. Submission entries are only handed to the kernel by uring_enter,
+ * or by uring_get_sqe when the queue is full.
+ */
+struct uring {
+    int fd;
+    unsigned features;
+
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe * sqes;
+    // the next entry to fill, the kernel sees the entries up to it on the next submission
+    unsigned tail;
+
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+
+    void * sq_map;
+    size_t sq_map_size;
+    void * cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+
+    size_t enters;
+};
+
+// receive buffers the kernel picks itself, multishot receives complete with the id of the buffer they filled
+struct uring_buffers {
+    struct io_uring_buf_ring * ring;
+    char * memory;
+    unsigned count; // a power of two
+    size_t size;
+    uint16_t group;
+};
+
+// whether the kernel has everything the server uses: extended enter arguments, multishot accept and receive,
+// provided buffer rings and zero-copy sendmsg
+bool uring_supported(void);
+
+bool uring_init(struct uring * uring, unsigned entries);
+// a zeroed submission entry
+struct io_uring_sqe * uring_get_sqe(struct uring * uring);
+// submits the pending entries and waits up to timeout_ms for a completion, returns false if the ring failed
+bool uring_enter(struct uring * uring, int timeout_ms);
+// the oldest completion not seen yet or NULL, it stays valid until uring_seen
+struct io_uring_cqe * uring_peek(struct uring * uring);
+void uring_seen(struct uring * uring);
+void uring_free(struct uring * uring);
+
+bool uring_buffers_init(struct uring_buffers * buffers, struct uring * uring, uint16_t group, unsigned count, size_t size);
+char * uring_buffer(struct uring_buffers * buffers, unsigned id);
+// gives a buffer back to the kernel once its data is consumed
+void uring_buffers_recycle(struct uring_buffers * buffers, unsigned id);
+void uring_buffers_free(struct uring_buffers * buffers, struct uring * uring);